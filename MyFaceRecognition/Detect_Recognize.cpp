@@ -1,13 +1,35 @@
 #include "Detect_Recognize.h"
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
 #include <iostream>
 #include <opencv2\imgproc.hpp>
 
 const double Detect_Recognize::TICK_FREQUENCY = cv::getTickFrequency();
+// Half resolution templates smaller than this are matched at full
+// resolution only
+const int Detect_Recognize::MIN_PYRAMID_TEMPLATE = 8;
+// Search radius of the full resolution refinement
+const int Detect_Recognize::REFINE_RADIUS = 2;
+// Face widths the fastest face may move between adaptive keyframes
+const double Detect_Recognize::MAX_KEYFRAME_DRIFT = 0.25;
+// Less confident interpolation triggers a keyframe on the next frame
+const double Detect_Recognize::MIN_INTERPOLATION_CONFIDENCE = 0.5;
+// Gray level change that counts as motion
+const double Detect_Recognize::MOTION_THRESHOLD = 20;
+// Weight of the current frame in the running-average background
+const double Detect_Recognize::BACKGROUND_RATE = 0.05;
+// Smaller changed boxes, in quarter resolution pixels, are noise
+const int Detect_Recognize::MIN_MOTION_AREA = 4;
+// Size ratio of neighboring confirmation scales
+const double Detect_Recognize::CONFIRMATION_STEP = 1.15;
 
 Detect_Recognize::Detect_Recognize(const std::string cascadeFilePath, cv::VideoCapture &videoCapture)
 {
 	setFaceCascade(cascadeFilePath);
 	setVideoCapture(videoCapture);
+	setTrackCapacity(16);
 }
 
 Detect_Recognize::~Detect_Recognize()
@@ -36,6 +58,10 @@ void Detect_Recognize::setFaceCascade(const std::string cascadeFilePath)
 		m_faceCascade->load(cascadeFilePath);
 	}
 
+	// Per-thread copies are loaded again on the next tiled search
+	m_cascadeFilePath = cascadeFilePath;
+	m_tileCascades.clear();
+
 	if (m_faceCascade->empty()) {
 		std::cerr << "Error creating cascade classifier. Make sure the file" << std::endl
 			<< cascadeFilePath << " exists." << std::endl;
@@ -59,7 +85,7 @@ int Detect_Recognize::resizedWidth() const
 
 bool Detect_Recognize::isFaceFound() const
 {
-	return m_foundFace;
+	return m_faceNum > 0;
 }
 
 cv::Point Detect_Recognize::centerOfRect(const cv::Rect &rect) const
@@ -69,13 +95,34 @@ cv::Point Detect_Recognize::centerOfRect(const cv::Rect &rect) const
 
 std::vector<cv::Rect> Detect_Recognize::face() const
 {
-	std::vector<cv::Rect> faceRect = m_trackedFace;
-	for (int i = 0; i < m_faceNum; i++)
+	std::vector<cv::Rect> faceRect;
+	for (int slot : m_activeSlots)
+	{
+		if (m_trackState[slot] == TRACK_LOST)
+			continue;
+		cv::Rect rect = m_trackedFace[slot];
+		rect.x = (int)(rect.x / m_scale);
+		rect.y = (int)(rect.y / m_scale);
+		rect.width = (int)(rect.width / m_scale);
+		rect.height = (int)(rect.height / m_scale);
+		faceRect.push_back(rect);
+	}
+	return faceRect;
+}
+
+std::vector<cv::Rect> Detect_Recognize::faceExtent() const
+{
+	std::vector<cv::Rect> faceRect;
+	for (int slot : m_activeSlots)
 	{
-		faceRect[i].x = (int)(faceRect[i].x / m_scale);
-		faceRect[i].y = (int)(faceRect[i].y / m_scale);
-		faceRect[i].width = (int)(faceRect[i].width / m_scale);
-		faceRect[i].height = (int)(faceRect[i].height / m_scale);
+		if (m_trackState[slot] == TRACK_LOST)
+			continue;
+		cv::Rect rect = m_faceExtent[slot];
+		rect.x = (int)(rect.x / m_scale);
+		rect.y = (int)(rect.y / m_scale);
+		rect.width = (int)(rect.width / m_scale);
+		rect.height = (int)(rect.height / m_scale);
+		faceRect.push_back(rect);
 	}
 	return faceRect;
 }
@@ -83,10 +130,11 @@ std::vector<cv::Rect> Detect_Recognize::face() const
 std::vector<cv::Point> Detect_Recognize::facePosition() const
 {
 	std::vector<cv::Point> facePos;
-	for (int i = 0; i < m_faceNum; i++)
+	for (int slot : m_activeSlots)
 	{
-		facePos[i].x = (int)(m_facePosition[i].x / m_scale);
-		facePos[i].y = (int)(m_facePosition[i].y / m_scale);
+		if (m_trackState[slot] == TRACK_LOST)
+			continue;
+		facePos.push_back(cv::Point((int)(m_facePosition[slot].x / m_scale), (int)(m_facePosition[slot].y / m_scale)));
 	}
 	return facePos;
 }
@@ -144,18 +192,35 @@ cv::Rect Detect_Recognize::biggestFace(std::vector<cv::Rect> &faces) const
 	return *biggest;
 }
 
+namespace
+{
+	// Header of size on buffer, which only grows, so steady per-track
+	// sizes stop allocating after the first frames
+	cv::Mat bufferView(cv::Mat &buffer, const cv::Size &size, int type)
+	{
+		if (buffer.type() != type || buffer.cols < size.width || buffer.rows < size.height)
+			buffer.create(std::max(buffer.rows, size.height), std::max(buffer.cols, size.width), type);
+		return buffer(cv::Rect(cv::Point(0, 0), size));
+	}
+}
+
 /*
-* Face template is small patch in the middle of detected face.
+* Face template is small patch in the middle of detected face, kept in
+* grayscale at full and half resolution.
 */
-cv::Mat Detect_Recognize::getFaceTemplate(const cv::Mat &frame, cv::Rect face)
+void Detect_Recognize::storeFaceTemplate(int slot, cv::Rect face)
 {
 	face.x += face.width / 4;
 	face.y += face.height / 4;
 	face.width /= 2;
 	face.height /= 2;
+	face &= cv::Rect(0, 0, m_gray.cols, m_gray.rows);
 
-	cv::Mat faceTemplate = frame(face).clone();
-	return faceTemplate;
+	m_faceTemplate[slot] = bufferView(m_templateBuffer[slot], face.size(), CV_8UC1);
+	m_gray(face).copyTo(m_faceTemplate[slot]);
+	m_smallTemplate[slot] = bufferView(m_smallTemplateBuffer[slot], cv::Size((face.width + 1) / 2, (face.height + 1) / 2), CV_8UC1);
+	if (face.area() > 0)
+		cv::pyrDown(m_faceTemplate[slot], m_smallTemplate[slot], m_smallTemplate[slot].size());
 }
 
 int Detect_Recognize::faceNum() const
@@ -163,205 +228,1046 @@ int Detect_Recognize::faceNum() const
 	return m_faceNum;
 }
 
-void Detect_Recognize::detectFaceAllSizes(const cv::Mat &frame)
+std::vector<int> Detect_Recognize::trackIds() const
 {
-	// Minimum face size is 1/5th of screen height
-	// Maximum face size is 2/3rds of screen height
-	m_faceCascade->detectMultiScale(frame, m_allFaces, 1.1, 3, 0,
-		cv::Size(frame.rows / 5, frame.rows / 5),
-		cv::Size(frame.rows * 2 / 3, frame.rows * 2 / 3));
+	std::vector<int> ids;
+	for (int slot : m_activeSlots)
+	{
+		if (m_trackState[slot] != TRACK_LOST)
+			ids.push_back(m_trackId[slot]);
+	}
+	return ids;
+}
+
+std::vector<int> Detect_Recognize::liveTrackIds() const
+{
+	std::vector<int> ids;
+	for (int slot : m_activeSlots)
+		ids.push_back(m_trackId[slot]);
+	return ids;
+}
+
+std::vector<double> Detect_Recognize::faceConfidence() const
+{
+	std::vector<double> confidences;
+	for (int slot : m_activeSlots)
+	{
+		if (m_trackState[slot] != TRACK_LOST)
+			confidences.push_back(m_faceConfidence[slot]);
+	}
+	return confidences;
+}
+
+std::vector<int> Detect_Recognize::trackStates() const
+{
+	std::vector<int> states;
+	for (int slot : m_activeSlots)
+	{
+		if (m_trackState[slot] != TRACK_LOST)
+			states.push_back(m_trackState[slot]);
+	}
+	return states;
+}
+
+void Detect_Recognize::setTrackCapacity(const int capacity)
+{
+	// Drops every track, the table is allocated once here
+	int slots = std::max(capacity, 1);
+	m_trackedFace.assign(slots, cv::Rect());
+	m_faceExtent.assign(slots, cv::Rect());
+	m_faceRoi.assign(slots, cv::Rect());
+	m_faceTemplate.assign(slots, cv::Mat());
+	m_smallTemplate.assign(slots, cv::Mat());
+	m_templateBuffer.assign(slots, cv::Mat());
+	m_smallTemplateBuffer.assign(slots, cv::Mat());
+	m_smallRoiBuffer.assign(slots, cv::Mat());
+	m_matchingBuffer.assign(slots, cv::Mat());
+	m_templateMatchingStartTime.assign(slots, 0);
+	m_templateMatchingCurrentTime.assign(slots, 0);
+	m_facePosition.assign(slots, cv::Point());
+	m_trackId.assign(slots, -1);
+	m_faceConfidence.assign(slots, DBL_MAX);
+	m_trackState.assign(slots, TRACK_FREE);
+	m_lostTime.assign(slots, 0);
+	// Every filter needs its own matrices, so no assign() from a prototype
+	m_kalman.clear();
+	m_kalman.resize(slots);
+	m_tracker.assign(slots, cv::Ptr<FaceTracker>());
+	m_trackingConfidence.assign(slots, 0);
+	m_interpolated.assign(slots, 0);
+	createTrackers();
+	m_activeSlots.clear();
+	m_activeSlots.reserve(slots);
+	m_freeSlots.clear();
+	for (int slot = slots - 1; slot >= 0; slot--)
+		m_freeSlots.push_back(slot);
+	m_faceNum = 0;
+}
+
+int Detect_Recognize::trackCapacity() const
+{
+	return (int)m_trackState.size();
+}
+
+void Detect_Recognize::setLostRetention(const double s)
+{
+	m_lostRetention = std::max(s, 0.0);
+}
+
+double Detect_Recognize::lostRetention() const
+{
+	return m_lostRetention;
+}
 
-	m_faceNum = m_allFaces.size();
+size_t Detect_Recognize::retiredTracks() const
+{
+	return m_retiredTracks;
+}
 
-	if (m_allFaces.empty()) return;
+size_t Detect_Recognize::droppedDetections() const
+{
+	return m_droppedDetections;
+}
 
-	m_foundFace = true;
+/*
+* Takes a slot from the free-list for a new track. When the table is full,
+* the lost track that was lost first is retired to make room; if no track
+* is lost the detection is dropped.
+*/
+int Detect_Recognize::openTrack(const cv::Mat &frame, const cv::Rect &face, double confidence)
+{
+	if (m_freeSlots.empty()) {
+		int oldest = -1;
+		for (int slot : m_activeSlots) {
+			if (m_trackState[slot] == TRACK_LOST && (oldest < 0 || m_lostTime[slot] < m_lostTime[oldest]))
+				oldest = slot;
+		}
+		if (oldest < 0) {
+			m_droppedDetections++;
+			return -1;
+		}
+		retireTrack(oldest);
+	}
 
-	m_templateMatchingRunning = false;
+	int slot = m_freeSlots.back();
+	m_freeSlots.pop_back();
+	m_activeSlots.push_back(slot);
+	m_trackId[slot] = m_nextTrackId++;
+	setTrackFace(frame, slot, face, confidence);
+	resetMotion(slot);
+	return slot;
+}
 
-	m_trackedFace.clear();
-	m_faceTemplate.clear();
-	m_faceRoi.clear();
-	m_facePosition.clear();
-	m_templateMatchingCurrentTime.clear();
-	m_templateMatchingStartTime.clear();
-	// Locate biggest face
-	//m_trackedFace = biggestFace(m_allFaces);
-	m_trackedFace = m_allFaces;
+void Detect_Recognize::retireTrack(int slot)
+{
+	m_activeSlots.erase(std::find(m_activeSlots.begin(), m_activeSlots.end(), slot));
+	m_freeSlots.push_back(slot);
+	m_trackState[slot] = TRACK_FREE;
+	m_trackId[slot] = -1;
+	m_faceTemplate[slot].release();
+	m_retiredTracks++;
+}
 
-	for (int i = 0; i < m_faceNum; i++)
-	{	
-		// Copy face template
-		m_faceTemplate.push_back(getFaceTemplate(frame, m_trackedFace[i]));
+/*
+* A cascade detection (re)starts the track in the detected state.
+*/
+void Detect_Recognize::setTrackFace(const cv::Mat &frame, int slot, const cv::Rect &face, double confidence)
+{
+	m_trackState[slot] = TRACK_DETECTED;
+	m_trackedFace[slot] = face;
+	m_faceExtent[slot] = face;
+	m_faceConfidence[slot] = confidence;
+	m_trackingConfidence[slot] = 1;
+	m_interpolated[slot] = 0;
+
+	// Copy face template, restart the tracker of the active backend
+	storeFaceTemplate(slot, face);
+	if (m_trackerBackend != TRACKER_TEMPLATE && !m_tracker[slot].empty())
+		m_tracker[slot]->init(m_gray, face);
+
+	// Calculate roi
+	m_faceRoi[slot] = doubleRectSize(face, cv::Rect(0, 0, frame.cols, frame.rows));
+
+	// Update face position
+	m_facePosition[slot] = centerOfRect(face);
+
+	m_templateMatchingCurrentTime[slot] = m_templateMatchingStartTime[slot] = 0;
+}
 
-		// Calculate roi
-		m_faceRoi.push_back(doubleRectSize(m_trackedFace[i], cv::Rect(0, 0, frame.cols, frame.rows)));
+/*
+* detectMultiScale that also returns the level weight of every detection,
+* a confidence for the quality gate.
+*/
+void Detect_Recognize::detectWithConfidence(const cv::Mat &frame, std::vector<cv::Rect> &faces, std::vector<double> &confidences,
+	const cv::Size &minSize, const cv::Size &maxSize)
+{
+	if (m_tiledDetection && detectTiled(frame, faces, confidences, minSize, maxSize))
+		return;
 
-		// Update face position
-		m_facePosition.push_back(centerOfRect(m_trackedFace[i]));
+	std::vector<int> rejectLevels;
+	m_faceCascade->detectMultiScale(frame, faces, rejectLevels, confidences, 1.1, 3, 0, minSize, maxSize, true);
+	if (confidences.size() != faces.size())
+		confidences.assign(faces.size(), DBL_MAX);
+}
 
-		m_templateMatchingCurrentTime.push_back(0);
-		m_templateMatchingStartTime.push_back(0);
+/*
+* Confirmation of a face of known size in image. For each of the scales
+* bracketing face, image is resized so the face maps onto the cascade
+* window, and detectMultiScale is asked for that single window size: one
+* integral image and one sliding-window sweep per scale, no pyramid.
+*/
+void Detect_Recognize::detectAtScales(const cv::Mat &image, const cv::Size &face, std::vector<cv::Rect> &faces, std::vector<double> &confidences)
+{
+	faces.clear();
+	confidences.clear();
+	cv::Size window = m_faceCascade->getOriginalWindowSize();
+	if (window.area() == 0 || face.area() == 0)
+		return;
+
+	cv::Mat resized;
+	for (int s = 0; s < m_confirmationScales; s++) {
+		// Neighboring scales are CONFIRMATION_STEP apart, centered on face
+		double expected = face.width * std::pow(CONFIRMATION_STEP, s - (m_confirmationScales - 1) / 2.0);
+		double ratio = window.width / expected;
+		cv::Size size(cvRound(image.cols * ratio), cvRound(image.rows * ratio));
+		if (size.width < window.width || size.height < window.height)
+			continue;
+		cv::resize(image, resized, size, 0, 0, ratio < 1 ? cv::INTER_AREA : cv::INTER_LINEAR);
+
+		std::vector<cv::Rect> found;
+		std::vector<int> rejectLevels;
+		std::vector<double> levelWeights;
+		// A single scale yields fewer overlapping hits than a pyramid
+		m_faceCascade->detectMultiScale(resized, found, rejectLevels, levelWeights, 1.1, 2, 0, window, window, true);
+		if (levelWeights.size() != found.size())
+			levelWeights.assign(found.size(), DBL_MAX);
+		for (size_t i = 0; i < found.size(); i++) {
+			faces.push_back(cv::Rect(cvRound(found[i].x / ratio), cvRound(found[i].y / ratio),
+				cvRound(found[i].width / ratio), cvRound(found[i].height / ratio)));
+			confidences.push_back(levelWeights[i]);
+		}
 	}
 }
 
-void Detect_Recognize::detectFaceAroundRoi(const cv::Mat &frame)
+void Detect_Recognize::setConfirmationScales(const int scales)
 {
-	std::vector<cv::Rect>   t_allFaces;
-	for (int i = 0; i < m_faceNum; i++)
+	m_confirmationScales = std::max(0, std::min(scales, 3));
+}
+
+int Detect_Recognize::confirmationScales() const
+{
+	return m_confirmationScales;
+}
+
+void Detect_Recognize::setTiledDetection(const bool enabled)
+{
+	m_tiledDetection = enabled;
+}
+
+bool Detect_Recognize::tiledDetection() const
+{
+	return m_tiledDetection;
+}
+
+namespace
+{
+	// One cascade pass over part of the frame for a range of face sizes
+	struct DetectionTask
+	{
+		cv::Rect			area;
+		cv::Size			minSize;
+		cv::Size			maxSize;
+	};
+
+	// Stripe k runs the tasks k, k + N, ... with cascade k, so no cascade
+	// is used by two threads at once
+	class TiledDetection : public cv::ParallelLoopBody
 	{
-		// Detect faces sized +/-20% off biggest face in previous search
-		m_faceCascade->detectMultiScale(frame(m_faceRoi[i]), t_allFaces, 1.1, 3, 0,
-			cv::Size(m_trackedFace[i].width * 8 / 10, m_trackedFace[i].height * 8 / 10),
-			cv::Size(m_trackedFace[i].width * 12 / 10, m_trackedFace[i].width * 12 / 10));
+	public:
+		TiledDetection(const cv::Mat &frame, const std::vector<DetectionTask> &tasks,
+			std::vector<cv::Ptr<cv::CascadeClassifier> > &cascades,
+			std::vector<std::vector<cv::Rect> > &faces, std::vector<std::vector<double> > &confidences) :
+			m_frame(frame), m_tasks(tasks), m_cascades(cascades), m_faces(faces), m_confidences(confidences)
+		{
+		}
 
-		if (t_allFaces.empty())
+		void operator()(const cv::Range &range) const
 		{
-			// Activate template matching if not already started and start timer
-			m_templateMatchingRunning = true;
-			if (m_templateMatchingStartTime[i] == 0)
-				m_templateMatchingStartTime[i] = cv::getTickCount();
-			return;
+			for (int stripe = range.start; stripe < range.end; stripe++) {
+				for (size_t t = stripe; t < m_tasks.size(); t += m_cascades.size()) {
+					const DetectionTask &task = m_tasks[t];
+					std::vector<int> rejectLevels;
+					m_cascades[stripe]->detectMultiScale(m_frame(task.area), m_faces[t], rejectLevels, m_confidences[t],
+						1.1, 3, 0, task.minSize, task.maxSize, true);
+					if (m_confidences[t].size() != m_faces[t].size())
+						m_confidences[t].assign(m_faces[t].size(), DBL_MAX);
+					for (auto &face : m_faces[t]) {
+						face.x += task.area.x;
+						face.y += task.area.y;
+					}
+				}
+			}
 		}
 
-		// Turn off template matching if running and reset timer
-		m_templateMatchingRunning = false;
-		m_templateMatchingCurrentTime[i] = m_templateMatchingStartTime[i] = 0;
+	private:
+		const cv::Mat &m_frame;
+		const std::vector<DetectionTask> &m_tasks;
+		std::vector<cv::Ptr<cv::CascadeClassifier> > &m_cascades;
+		std::vector<std::vector<cv::Rect> > &m_faces;
+		std::vector<std::vector<double> > &m_confidences;
+	};
 
-		// Get detected face
-		m_trackedFace[i] = biggestFace(t_allFaces);
+	// Tile origins along one axis, the last tile aligned with the end
+	std::vector<int> tileOrigins(int length, int tile, int stride)
+	{
+		std::vector<int> origins;
+		for (int pos = 0; ; pos += stride) {
+			if (pos + tile >= length) {
+				origins.push_back(std::max(length - tile, 0));
+				break;
+			}
+			origins.push_back(pos);
+		}
+		return origins;
+	}
+}
 
-		// Add roi offset to face
-		m_trackedFace[i].x += m_faceRoi[i].x;
-		m_trackedFace[i].y += m_faceRoi[i].y;
+/*
+* Most of the cascade work is in the small face sizes, where the image is
+* scanned at full resolution. Those sizes (up to twice the minimum) are
+* searched in tiles of four times that size, overlapping by one face so
+* every face lies entirely in some tile; larger faces get one pass over
+* the whole area. All passes run in parallel, duplicates along the tile
+* borders are removed by non-maximum suppression. Returns false if the
+* area is too small to be worth splitting.
+*/
+bool Detect_Recognize::detectTiled(const cv::Mat &frame, std::vector<cv::Rect> &faces, std::vector<double> &confidences,
+	const cv::Size &minSize, const cv::Size &maxSize)
+{
+	int split = std::min(std::max(minSize.width, minSize.height) * 2, std::max(maxSize.width, maxSize.height));
+	int tile = split * 4;
+	if (split <= 0 || (frame.cols <= tile && frame.rows <= tile))
+		return false;
+
+	std::vector<DetectionTask> tasks;
+	if (split < std::max(maxSize.width, maxSize.height)) {
+		DetectionTask coarse = { cv::Rect(0, 0, frame.cols, frame.rows), cv::Size(split, split), maxSize };
+		tasks.push_back(coarse);
+	}
+	std::vector<int> xs = tileOrigins(frame.cols, tile, tile - split);
+	std::vector<int> ys = tileOrigins(frame.rows, tile, tile - split);
+	for (int y : ys) {
+		for (int x : xs) {
+			DetectionTask task = { cv::Rect(x, y, std::min(tile, frame.cols - x), std::min(tile, frame.rows - y)),
+				minSize, cv::Size(split, split) };
+			tasks.push_back(task);
+		}
+	}
 
-		// Get face template
-		m_faceTemplate[i] = getFaceTemplate(frame, m_trackedFace[i]);
+	// One cascade per thread, loaded from the same file
+	int threads = std::max(1, std::min(cv::getNumThreads(), (int)tasks.size()));
+	while ((int)m_tileCascades.size() < threads) {
+		cv::Ptr<cv::CascadeClassifier> cascade = cv::makePtr<cv::CascadeClassifier>();
+		if (!cascade->load(m_cascadeFilePath))
+			return false;
+		m_tileCascades.push_back(cascade);
+	}
+	std::vector<cv::Ptr<cv::CascadeClassifier> > cascades(m_tileCascades.begin(), m_tileCascades.begin() + threads);
 
-		// Calculate roi
-		m_faceRoi[i] = doubleRectSize(m_trackedFace[i], cv::Rect(0, 0, frame.cols, frame.rows));
+	std::vector<std::vector<cv::Rect> > tileFaces(tasks.size());
+	std::vector<std::vector<double> > tileConfidences(tasks.size());
+	cv::parallel_for_(cv::Range(0, threads), TiledDetection(frame, tasks, cascades, tileFaces, tileConfidences), threads);
 
-		// Update face position
-		m_facePosition[i] = centerOfRect(m_trackedFace[i]);
+	// Non-maximum suppression, most confident first
+	std::vector<std::pair<double, cv::Rect> > candidates;
+	for (size_t t = 0; t < tasks.size(); t++) {
+		for (size_t i = 0; i < tileFaces[t].size(); i++)
+			candidates.push_back(std::make_pair(tileConfidences[t][i], tileFaces[t][i]));
 	}
+	std::stable_sort(candidates.begin(), candidates.end(),
+		[](const std::pair<double, cv::Rect> &a, const std::pair<double, cv::Rect> &b) { return a.first > b.first; });
+	faces.clear();
+	confidences.clear();
+	for (const auto &candidate : candidates) {
+		bool duplicate = false;
+		for (const auto &face : faces) {
+			// A cut-off face in one tile is mostly inside the whole one
+			double overlap = (double)(candidate.second & face).area() / std::min(candidate.second.area(), face.area());
+			if (overlap > 0.5) {
+				duplicate = true;
+				break;
+			}
+		}
+		if (!duplicate) {
+			faces.push_back(candidate.second);
+			confidences.push_back(candidate.first);
+		}
+	}
+	return true;
 }
 
-void Detect_Recognize::detectFacesTemplateMatching(const cv::Mat &frame)
+void Detect_Recognize::detectFaceAllSizes(const cv::Mat &frame)
 {
-	for (int i = 0; i < m_faceNum; i++)
-	{
-		// Calculate duration of template matching
-		m_templateMatchingCurrentTime[i] = cv::getTickCount();
-		double duration = (double)(m_templateMatchingCurrentTime[i] - m_templateMatchingStartTime[i]) / TICK_FREQUENCY;
-
-		// If template matching lasts for more than 2 seconds face is possibly lost
-		// so disable it and redetect using cascades
-		if (duration > m_templateMatchingMaxDuration) {
-			m_foundFace = false;
-			m_templateMatchingRunning = false;
-			m_templateMatchingStartTime[i] = m_templateMatchingCurrentTime[i] = 0;
-			m_facePosition[i].x = m_facePosition[i].y = 0;
-			m_trackedFace[i].x = m_trackedFace[i].y = m_trackedFace[i].width = m_trackedFace[i].height = 0;
-			return;
+	if (m_motionGating) {
+		detectFacesInMotion(frame, cv::Rect(0, 0, frame.cols, frame.rows));
+		return;
+	}
+
+	// Minimum face size is 1/5th of screen height
+	// Maximum face size is 2/3rds of screen height
+	std::vector<double> confidences;
+	detectWithConfidence(frame, m_allFaces, confidences,
+		cv::Size(frame.rows / 5, frame.rows / 5),
+		cv::Size(frame.rows * 2 / 3, frame.rows * 2 / 3));
+
+	addDetections(frame, m_allFaces, confidences);
+}
+
+bool Detect_Recognize::detectFaceAroundRoi(const cv::Mat &frame, int slot, cv::Rect &face, double &confidence)
+{
+	std::vector<cv::Rect>   t_allFaces;
+	std::vector<double>     t_confidences;
+
+	// Detect faces sized +/-20% off biggest face in previous search
+	if (m_confirmationScales > 0)
+		detectAtScales(frame(m_faceRoi[slot]), m_trackedFace[slot].size(), t_allFaces, t_confidences);
+	else
+		detectWithConfidence(frame(m_faceRoi[slot]), t_allFaces, t_confidences,
+			cv::Size(m_trackedFace[slot].width * 8 / 10, m_trackedFace[slot].height * 8 / 10),
+			cv::Size(m_trackedFace[slot].width * 12 / 10, m_trackedFace[slot].width * 12 / 10));
+
+	if (t_allFaces.empty())
+		return false;
+
+	// Get detected face
+	face = biggestFace(t_allFaces);
+	confidence = t_confidences[std::find(t_allFaces.begin(), t_allFaces.end(), face) - t_allFaces.begin()];
+
+	// Add roi offset to face
+	face.x += m_faceRoi[slot].x;
+	face.y += m_faceRoi[slot].y;
+	return true;
+}
+
+void Detect_Recognize::setRoiConsolidation(const bool enabled)
+{
+	m_roiConsolidation = enabled;
+}
+
+bool Detect_Recognize::roiConsolidation() const
+{
+	return m_roiConsolidation;
+}
+
+int Detect_Recognize::roiPassesPerFrame() const
+{
+	return m_lastRoiPasses;
+}
+
+/*
+* Cascade re-detection for the tracks in slots with a single detectMultiScale
+* call. Overlapping rois are merged into their union; the resulting regions
+* are shelf-packed into one mosaic, separated by guard bands as wide as
+* the largest detection window so no window sees two regions. With
+* confirmation scales every region is resized so the faces of its tracks
+* match the cascade window, and the mosaic is scanned at those scales
+* only; rois are merged only while their face sizes stay within the
+* confirmation range. Detections that fit inside one region go back to
+* the tracks whose roi holds their center and whose size range they match.
+* faces[k] stays empty if track slots[k] was not found.
+*/
+void Detect_Recognize::detectFacesAroundRois(const cv::Mat &frame, const std::vector<int> &slots,
+	std::vector<cv::Rect> &faces, std::vector<double> &confidences)
+{
+	faces.assign(slots.size(), cv::Rect());
+	confidences.assign(slots.size(), DBL_MAX);
+	if (slots.empty())
+		return;
+
+	if (!m_roiConsolidation) {
+		for (size_t k = 0; k < slots.size(); k++) {
+			detectFaceAroundRoi(frame, slots[k], faces[k], confidences[k]);
+			m_roiPasses++;
 		}
+		return;
+	}
 
-		// Edge case when face exits frame while 
-		if (m_faceTemplate[i].rows * m_faceTemplate[i].cols == 0 || m_faceTemplate[i].rows <= 1 || m_faceTemplate[i].cols <= 1) {
-			m_foundFace = false;
-			m_templateMatchingRunning = false;
-			m_templateMatchingStartTime[i] = m_templateMatchingCurrentTime[i] = 0;
-			m_facePosition[i].x = m_facePosition[i].y = 0;
-			m_trackedFace[i].x = m_trackedFace[i].y = m_trackedFace[i].width = m_trackedFace[i].height = 0;
-			return;
+	// Widest face size ratio one region may hold: the confirmation scales
+	// span CONFIRMATION_STEP^(scales - 1) around the scale of the region
+	cv::Size window = m_faceCascade->getOriginalWindowSize();
+	bool confirm = m_confirmationScales > 0 && window.area() > 0;
+	double span = confirm ? std::pow(CONFIRMATION_STEP, m_confirmationScales - 1) : DBL_MAX;
+
+	// Union overlapping rois of similar faces until no two can be merged
+	std::vector<cv::Rect> regions;
+	std::vector<std::vector<int> > members;
+	std::vector<int> minWidth, maxWidth;
+	for (size_t k = 0; k < slots.size(); k++) {
+		regions.push_back(m_faceRoi[slots[k]]);
+		members.push_back(std::vector<int>(1, (int)k));
+		minWidth.push_back(std::max(m_trackedFace[slots[k]].width, 1));
+		maxWidth.push_back(minWidth.back());
+	}
+	for (bool merged = true; merged;) {
+		merged = false;
+		for (size_t i = 0; i < regions.size() && !merged; i++) {
+			for (size_t j = i + 1; j < regions.size() && !merged; j++) {
+				int low = std::min(minWidth[i], minWidth[j]), high = std::max(maxWidth[i], maxWidth[j]);
+				if ((regions[i] & regions[j]).area() > 0 && high <= low * span) {
+					regions[i] |= regions[j];
+					members[i].insert(members[i].end(), members[j].begin(), members[j].end());
+					minWidth[i] = low;
+					maxWidth[i] = high;
+					regions.erase(regions.begin() + j);
+					members.erase(members.begin() + j);
+					minWidth.erase(minWidth.begin() + j);
+					maxWidth.erase(maxWidth.begin() + j);
+					merged = true;
+				}
+			}
 		}
+	}
 
-		// Template matching with last known face 
-		//cv::matchTemplate(frame(m_faceRoi), m_faceTemplate, m_matchingResult, CV_TM_CCOEFF);
-		cv::matchTemplate(frame(m_faceRoi[i]), m_faceTemplate[i], m_matchingResult, CV_TM_SQDIFF_NORMED);
-		cv::normalize(m_matchingResult, m_matchingResult, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
-		double min, max;
-		cv::Point minLoc, maxLoc;
-		cv::minMaxLoc(m_matchingResult, &min, &max, &minLoc, &maxLoc);
+	// Sizes +/-20% off every tracked face
+	cv::Size minSize(INT_MAX, INT_MAX), maxSize(0, 0);
+	for (int slot : slots) {
+		minSize.width = std::min(minSize.width, m_trackedFace[slot].width * 8 / 10);
+		minSize.height = std::min(minSize.height, m_trackedFace[slot].height * 8 / 10);
+		maxSize.width = std::max(maxSize.width, m_trackedFace[slot].width * 12 / 10);
+		maxSize.height = std::max(maxSize.height, m_trackedFace[slot].height * 12 / 10);
+	}
 
-		// Add roi offset to face position
-		minLoc.x += m_faceRoi[i].x;
-		minLoc.y += m_faceRoi[i].y;
+	// Mosaic pixels per frame pixel of every region; the geometric mean of
+	// its smallest and largest face maps onto the cascade window
+	std::vector<double> ratios(regions.size(), 1.0);
+	std::vector<cv::Size> tileSizes(regions.size());
+	for (size_t i = 0; i < regions.size(); i++) {
+		if (confirm)
+			ratios[i] = window.width / std::sqrt((double)minWidth[i] * maxWidth[i]);
+		tileSizes[i] = cv::Size(std::max(cvRound(regions[i].width * ratios[i]), 1), std::max(cvRound(regions[i].height * ratios[i]), 1));
+	}
 
-		// Get detected face
-		//m_trackedFace = cv::Rect(maxLoc.x, maxLoc.y, m_trackedFace.width, m_trackedFace.height);
-		m_trackedFace[i] = cv::Rect(minLoc.x, minLoc.y, m_faceTemplate[i].cols, m_faceTemplate[i].rows);
-		m_trackedFace[i] = doubleRectSize(m_trackedFace[i], cv::Rect(0, 0, frame.cols, frame.rows));
+	// The largest window of the scan, in mosaic pixels
+	int guardBand = confirm ?
+		cvCeil(std::max(window.width, window.height) * std::pow(CONFIRMATION_STEP, (m_confirmationScales - 1) / 2.0)) :
+		std::max(maxSize.width, maxSize.height);
+
+	// Shelf packing, tallest regions first
+	std::vector<cv::Rect> tiles(regions.size());
+	cv::Mat mosaic;
+	if (regions.size() == 1 && !confirm) {
+		mosaic = frame(regions[0]);
+		tiles[0] = cv::Rect(cv::Point(0, 0), tileSizes[0]);
+	}
+	else {
+		std::vector<int> order(regions.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = (int)i;
+		std::sort(order.begin(), order.end(), [&tileSizes](int a, int b) { return tileSizes[a].height > tileSizes[b].height; });
+		int limit = frame.cols, x = 0, y = 0, shelfHeight = 0, width = 0;
+		for (int i : order) {
+			if (x > 0 && x + tileSizes[i].width > limit) {
+				y += shelfHeight + guardBand;
+				x = shelfHeight = 0;
+			}
+			tiles[i] = cv::Rect(cv::Point(x, y), tileSizes[i]);
+			x += tileSizes[i].width + guardBand;
+			shelfHeight = std::max(shelfHeight, tileSizes[i].height);
+			width = std::max(width, tiles[i].x + tiles[i].width);
+		}
+		mosaic.create(y + shelfHeight, width, frame.type());
+		mosaic.setTo(cv::Scalar::all(0));
+		for (size_t i = 0; i < regions.size(); i++) {
+			if (tileSizes[i] == regions[i].size())
+				frame(regions[i]).copyTo(mosaic(tiles[i]));
+			else
+				cv::resize(frame(regions[i]), mosaic(tiles[i]), tileSizes[i], 0, 0, cv::INTER_AREA);
+		}
+	}
 
-		// Get new face template
-		m_faceTemplate[i] = getFaceTemplate(frame, m_trackedFace[i]);
+	std::vector<cv::Rect> found;
+	std::vector<double> foundConfidences;
+	if (confirm)
+		detectAtScales(mosaic, window, found, foundConfidences);
+	else
+		detectWithConfidence(mosaic, found, foundConfidences, minSize, maxSize);
+	m_roiPasses++;
+
+	// Back to frame coordinates and to the tracks
+	std::vector<std::vector<cv::Rect> > candidates(slots.size());
+	std::vector<std::vector<double> > candidateConfidences(slots.size());
+	for (size_t d = 0; d < found.size(); d++) {
+		for (size_t i = 0; i < tiles.size(); i++) {
+			if ((found[d] & tiles[i]) != found[d])
+				continue;
+			cv::Rect local = found[d] - tiles[i].tl();
+			cv::Rect face(regions[i].x + cvRound(local.x / ratios[i]), regions[i].y + cvRound(local.y / ratios[i]),
+				cvRound(local.width / ratios[i]), cvRound(local.height / ratios[i]));
+			cv::Point center = centerOfRect(face);
+			for (int k : members[i]) {
+				const cv::Rect &tracked = m_trackedFace[slots[k]];
+				if (m_faceRoi[slots[k]].contains(center) &&
+					face.width >= tracked.width * 8 / 10 && face.width <= tracked.width * 12 / 10) {
+					candidates[k].push_back(face);
+					candidateConfidences[k].push_back(foundConfidences[d]);
+				}
+			}
+			break;
+		}
+	}
+	for (size_t k = 0; k < slots.size(); k++) {
+		if (candidates[k].empty())
+			continue;
+		faces[k] = biggestFace(candidates[k]);
+		confidences[k] = candidateConfidences[k][std::find(candidates[k].begin(), candidates[k].end(), faces[k]) - candidates[k].begin()];
+	}
+}
 
-		// Calculate face roi
-		m_faceRoi[i] = doubleRectSize(m_trackedFace[i], cv::Rect(0, 0, frame.cols, frame.rows));
+bool Detect_Recognize::detectFacesTemplateMatching(const cv::Mat &frame, int slot)
+{
+	// Edge case when face exits frame while 
+	if (m_faceTemplate[slot].rows * m_faceTemplate[slot].cols == 0 || m_faceTemplate[slot].rows <= 1 || m_faceTemplate[slot].cols <= 1)
+		return false;
+
+	// Template matching with last known face, coarse to fine: the half
+	// resolution template over the half resolution roi, then the full
+	// template within REFINE_RADIUS pixels of the coarse match
+	const cv::Mat &faceTemplate = m_faceTemplate[slot];
+	cv::Mat roi = m_gray(m_faceRoi[slot]);
+	if (roi.cols < faceTemplate.cols || roi.rows < faceTemplate.rows)
+		return false;
+	cv::Rect window(0, 0, roi.cols, roi.rows);
+	if (std::min(m_smallTemplate[slot].cols, m_smallTemplate[slot].rows) >= MIN_PYRAMID_TEMPLATE) {
+		cv::Mat smallRoi = bufferView(m_smallRoiBuffer[slot], cv::Size((roi.cols + 1) / 2, (roi.rows + 1) / 2), CV_8UC1);
+		cv::pyrDown(roi, smallRoi, smallRoi.size());
+		cv::Mat result = bufferView(m_matchingBuffer[slot],
+			cv::Size(smallRoi.cols - m_smallTemplate[slot].cols + 1, smallRoi.rows - m_smallTemplate[slot].rows + 1), CV_32FC1);
+		cv::matchTemplate(smallRoi, m_smallTemplate[slot], result, CV_TM_SQDIFF_NORMED);
+		cv::Point coarse;
+		cv::minMaxLoc(result, NULL, NULL, &coarse, NULL);
+		window = cv::Rect(coarse.x * 2 - REFINE_RADIUS, coarse.y * 2 - REFINE_RADIUS,
+			faceTemplate.cols + 2 * REFINE_RADIUS, faceTemplate.rows + 2 * REFINE_RADIUS) & window;
+	}
+	cv::Mat result = bufferView(m_matchingBuffer[slot],
+		cv::Size(window.width - faceTemplate.cols + 1, window.height - faceTemplate.rows + 1), CV_32FC1);
+	cv::matchTemplate(roi(window), faceTemplate, result, CV_TM_SQDIFF_NORMED);
+	double minVal;
+	cv::Point minLoc;
+	cv::minMaxLoc(result, &minVal, NULL, &minLoc, NULL);
+	minLoc += window.tl();
+	m_trackingConfidence[slot] = std::max(0.0, 1.0 - minVal);
+
+	// Add roi offset to face position
+	minLoc.x += m_faceRoi[slot].x;
+	minLoc.y += m_faceRoi[slot].y;
+
+	// Get detected face
+	//m_trackedFace = cv::Rect(maxLoc.x, maxLoc.y, m_trackedFace.width, m_trackedFace.height);
+	m_trackedFace[slot] = cv::Rect(minLoc.x, minLoc.y, m_faceTemplate[slot].cols, m_faceTemplate[slot].rows);
+	m_faceExtent[slot] = cv::Rect(minLoc.x - m_faceTemplate[slot].cols / 2, minLoc.y - m_faceTemplate[slot].rows / 2,
+		m_faceTemplate[slot].cols * 2, m_faceTemplate[slot].rows * 2);
+	m_trackedFace[slot] = doubleRectSize(m_trackedFace[slot], cv::Rect(0, 0, frame.cols, frame.rows));
+
+	// Get new face template
+	storeFaceTemplate(slot, m_trackedFace[slot]);
+
+	// Calculate face roi
+	m_faceRoi[slot] = doubleRectSize(m_trackedFace[slot], cv::Rect(0, 0, frame.cols, frame.rows));
+
+	// Update face position
+	m_facePosition[slot] = centerOfRect(m_trackedFace[slot]);
+	return true;
+}
 
-		// Update face position
-		m_facePosition[i] = centerOfRect(m_trackedFace[i]);
+void Detect_Recognize::setTrackerBackend(const int backend)
+{
+	m_trackerBackend = (backend == TRACKER_OPTICAL_FLOW || backend == TRACKER_CORRELATION) ? backend : TRACKER_TEMPLATE;
+	createTrackers();
+}
+
+int Detect_Recognize::trackerBackend() const
+{
+	return m_trackerBackend;
+}
+
+void Detect_Recognize::setTrackerBudget(const double ms)
+{
+	m_trackerBudget = std::max(ms, 0.0);
+}
+
+double Detect_Recognize::trackerBudget() const
+{
+	return m_trackerBudget;
+}
+
+double Detect_Recognize::trackerTimePerFrame() const
+{
+	return m_lastTrackerTime;
+}
+
+size_t Detect_Recognize::trackerFallbacks() const
+{
+	return m_trackerFallbacks;
+}
+
+size_t Detect_Recognize::trackerSkips() const
+{
+	return m_trackerSkips;
+}
+
+void Detect_Recognize::createTrackers()
+{
+	// Active tracks get a tracker with their next detection
+	for (size_t slot = 0; slot < m_tracker.size(); slot++) {
+		if (m_trackerBackend == TRACKER_OPTICAL_FLOW)
+			m_tracker[slot] = cv::makePtr<OpticalFlowTracker>();
+		else if (m_trackerBackend == TRACKER_CORRELATION)
+			m_tracker[slot] = cv::makePtr<CorrelationTracker>();
+		else
+			m_tracker[slot].release();
 	}
 }
 
-bool Detect_Recognize::isAround(const cv::Rect &rect) const
+/*
+* Follows a track without cascade hit with the tracker backend. Once the
+* trackers have used up m_trackerBudget this frame, the remaining tracks
+* keep their last position. Returns false if template matching should
+* take over.
+*/
+bool Detect_Recognize::followTrack(const cv::Mat &frame, int slot)
 {
-	for (int i = 0; i < m_faceNum; i++)
+	if (m_trackerBackend == TRACKER_TEMPLATE || m_tracker[slot].empty())
+		return false;
+	if (m_trackerTime >= m_trackerBudget) {
+		m_trackerSkips++;
+		return true;
+	}
+
+	int64 start = cv::getTickCount();
+	cv::Rect extent;
+	bool found = m_tracker[slot]->update(m_gray, extent);
+	m_trackerTime += (cv::getTickCount() - start) * 1000.0 / TICK_FREQUENCY;
+	cv::Rect face = extent & cv::Rect(0, 0, frame.cols, frame.rows);
+	if (!found || face.area() == 0) {
+		m_trackerFallbacks++;
+		return false;
+	}
+
+	// Keep the template current for the fallback
+	m_trackedFace[slot] = face;
+	m_faceExtent[slot] = extent;
+	m_trackingConfidence[slot] = m_tracker[slot]->confidence();
+	storeFaceTemplate(slot, face);
+	m_faceRoi[slot] = doubleRectSize(face, cv::Rect(0, 0, frame.cols, frame.rows));
+	m_facePosition[slot] = centerOfRect(face);
+	correctMotion(slot);
+	return true;
+}
+
+void Detect_Recognize::setKeyframeInterval(const int frames, const int mode)
+{
+	m_keyframeInterval = std::max(frames, 1);
+	m_keyframeMode = (mode == KEYFRAME_ADAPTIVE) ? KEYFRAME_ADAPTIVE : KEYFRAME_FIXED;
+	m_currentKeyframeInterval = m_keyframeInterval;
+}
+
+int Detect_Recognize::keyframeInterval() const
+{
+	return m_keyframeInterval;
+}
+
+int Detect_Recognize::keyframeMode() const
+{
+	return m_keyframeMode;
+}
+
+int Detect_Recognize::currentKeyframeInterval() const
+{
+	return m_currentKeyframeInterval;
+}
+
+Detect_Recognize::KeyframeStats Detect_Recognize::keyframeStats() const
+{
+	return m_keyframeStats;
+}
+
+std::vector<double> Detect_Recognize::trackingConfidence() const
+{
+	std::vector<double> confidences;
+	for (int slot : m_activeSlots)
 	{
-		cv::Point centerFace, centerRect;
-		centerFace = centerOfRect(m_trackedFace[i]);
-		centerRect = centerOfRect(rect);
-		if (abs(centerFace.x - centerRect.x) < ((m_trackedFace[i].width + rect.width)/ 2))
-		{
-			if (abs(centerFace.y - centerRect.y) < ((m_trackedFace[i].height + rect.height) / 2))
-			{
-				return true;
-			}
-		}
+		if (m_trackState[slot] != TRACK_LOST)
+			confidences.push_back(m_trackingConfidence[slot]);
 	}
-	return false;
+	return confidences;
 }
 
-void Detect_Recognize::detectFacesOther(const cv::Mat &frame)
+/*
+* The cascade runs on every m_currentKeyframeInterval-th frame, and right
+* away while nothing is tracked or after a tracker lost its face.
+*/
+bool Detect_Recognize::isKeyframe() const
 {
-	
-	// Minimum face size is 1/5th of screen height
-	// Maximum face size is 2/3rds of screen height
-	std::vector<cv::Rect>   allFaces;
+	if (m_forceKeyframe || m_faceNum == 0)
+		return true;
+	return m_framesSinceKeyframe + 1 >= m_currentKeyframeInterval;
+}
 
-	m_faceCascade->detectMultiScale(frame, allFaces, 1.1, 3, 0,
-		cv::Size(frame.rows / 5, frame.rows / 5),
-		cv::Size(frame.rows * 2 / 3, frame.rows * 2 / 3));
+/*
+* Adaptive mode: the fastest face, from its Kalman velocity, may move
+* MAX_KEYFRAME_DRIFT of its width until the next keyframe.
+*/
+void Detect_Recognize::updateKeyframeInterval()
+{
+	m_currentKeyframeInterval = m_keyframeInterval;
+	if (m_keyframeMode != KEYFRAME_ADAPTIVE || m_motionModel != MOTION_KALMAN)
+		return;
 
-	size_t faceNum = allFaces.size();
+	double speed = 0;
+	for (int slot : m_activeSlots) {
+		if (m_trackState[slot] == TRACK_LOST)
+			continue;
+		const cv::Mat &state = m_kalman[slot].statePost;
+		double pixels = std::sqrt(state.at<float>(2) * state.at<float>(2) + state.at<float>(3) * state.at<float>(3));
+		speed = std::max(speed, pixels / std::max(m_trackedFace[slot].width, 1));
+	}
+	if (speed > 0)
+		m_currentKeyframeInterval = std::max(1, std::min(m_keyframeInterval, (int)(MAX_KEYFRAME_DRIFT / speed)));
+}
 
-	if (allFaces.empty()) return;
+/*
+* Moves a track on a frame between keyframes with the tracker backend, or
+* with template matching without one. A track that is lost or followed
+* with little confidence keeps its last position and asks for a keyframe.
+*/
+void Detect_Recognize::interpolateTrack(const cv::Mat &frame, int slot)
+{
+	m_interpolated[slot] = 1;
+	bool found = followTrack(frame, slot);
+	if (!found && detectFacesTemplateMatching(frame, slot)) {
+		correctMotion(slot);
+		found = true;
+	}
+	if (!found || m_trackingConfidence[slot] < MIN_INTERPOLATION_CONFIDENCE)
+		m_forceKeyframe = true;
+}
+
+/*
+* Compares the interpolated position of a track with the cascade result
+* of the keyframe.
+*/
+void Detect_Recognize::verifyInterpolation(int slot, const cv::Rect &face)
+{
+	if (face.area() == 0) {
+		m_keyframeStats.missed++;
+		return;
+	}
+	const cv::Rect &interpolated = m_trackedFace[slot];
+	double overlap = (double)(interpolated & face).area() / (interpolated | face).area();
+	m_keyframeStats.verified++;
+	m_keyframeStats.overlapSum += overlap;
+	if (overlap < 0.5)
+		m_keyframeStats.drifted++;
+}
 
-	m_foundFace = true;
+/*
+* Per-track state machine: a cascade hit in the roi keeps or puts the
+* track in the detected state, a miss switches it to the tracker backend
+* with template matching as fallback, and following that runs too long or
+* loses the target marks it lost. Lost tracks are kept for m_lostRetention seconds so a new
+* detection at the same place gets the old id back. face is the cascade
+* hit in the roi of the track, empty if there was none.
+*/
+void Detect_Recognize::updateTrack(const cv::Mat &frame, int slot, const cv::Rect &face, double confidence, int64 now)
+{
+	if (m_interpolated[slot]) {
+		verifyInterpolation(slot, face);
+		m_interpolated[slot] = 0;
+	}
 
-	m_templateMatchingRunning = false;
+	if (face.area() > 0) {
+		setTrackFace(frame, slot, face, confidence);
+		correctMotion(slot);
+		return;
+	}
 
-	// Locate biggest face
-	//m_trackedFace = biggestFace(m_allFaces);
+	// Activate template matching if not already started and start timer
+	if (m_trackState[slot] == TRACK_DETECTED) {
+		m_trackState[slot] = TRACK_TEMPLATE;
+		m_templateMatchingStartTime[slot] = now;
+	}
+	// If following lasts for more than m_templateMatchingMaxDuration seconds face is possibly lost
+	m_templateMatchingCurrentTime[slot] = now;
+	bool expired = (now - m_templateMatchingStartTime[slot]) / TICK_FREQUENCY > m_templateMatchingMaxDuration;
+	if (!expired && followTrack(frame, slot))
+		return;
+	if (expired || !detectFacesTemplateMatching(frame, slot)) {
+		m_trackState[slot] = TRACK_LOST;
+		m_lostTime[slot] = now;
+		m_templateMatchingStartTime[slot] = m_templateMatchingCurrentTime[slot] = 0;
+	}
+	else {
+		correctMotion(slot);
+	}
+}
+
+void Detect_Recognize::setMotionModel(const int model)
+{
+	m_motionModel = (model == MOTION_KALMAN) ? MOTION_KALMAN : MOTION_NONE;
+}
+
+int Detect_Recognize::motionModel() const
+{
+	return m_motionModel;
+}
 
-	for (int i = 0; i < faceNum; i++)
+double Detect_Recognize::roiAreaPerFrame() const
+{
+	return (double)m_lastRoiArea;
+}
+
+/*
+* Constant-velocity Kalman filter on the face center, state (x, y, vx, vy)
+* in resized-frame pixels per frame, measurement (x, y).
+*/
+void Detect_Recognize::resetMotion(int slot)
+{
+	cv::KalmanFilter &kalman = m_kalman[slot];
+	kalman.init(4, 2, 0, CV_32F);
+	kalman.transitionMatrix = (cv::Mat_<float>(4, 4) <<
+		1, 0, 1, 0,
+		0, 1, 0, 1,
+		0, 0, 1, 0,
+		0, 0, 0, 1);
+	cv::setIdentity(kalman.measurementMatrix);
+	// Faces accelerate slowly, detections jitter by a few pixels
+	cv::setIdentity(kalman.processNoiseCov, cv::Scalar::all(0.5));
+	cv::setIdentity(kalman.measurementNoiseCov, cv::Scalar::all(4));
+	// Unknown velocity at the start: wide first rois
+	cv::setIdentity(kalman.errorCovPost, cv::Scalar::all(4));
+	kalman.errorCovPost.at<float>(2, 2) = kalman.errorCovPost.at<float>(3, 3) = 100;
+	kalman.statePost = (cv::Mat_<float>(4, 1) <<
+		(float)m_facePosition[slot].x, (float)m_facePosition[slot].y, 0.f, 0.f);
+}
+
+void Detect_Recognize::correctMotion(int slot)
+{
+	if (m_motionModel != MOTION_KALMAN)
+		return;
+	cv::Mat measurement = (cv::Mat_<float>(2, 1) << (float)m_facePosition[slot].x, (float)m_facePosition[slot].y);
+	m_kalman[slot].correct(measurement);
+}
+
+/*
+* Search roi around the predicted center: the face plus the 20% size change
+* the cascade allows, plus three standard deviations of the predicted
+* position. Never larger than the doubled face of the fixed scheme.
+*/
+cv::Rect Detect_Recognize::predictRoi(const cv::Mat &frame, int slot)
+{
+	cv::KalmanFilter &kalman = m_kalman[slot];
+	const cv::Mat &prediction = kalman.predict();
+	float x = prediction.at<float>(0), y = prediction.at<float>(1);
+	float sigmaX = std::sqrt(kalman.errorCovPre.at<float>(0, 0));
+	float sigmaY = std::sqrt(kalman.errorCovPre.at<float>(1, 1));
+
+	const cv::Rect &face = m_trackedFace[slot];
+	int halfWidth = std::min((int)(face.width * 0.6f + 3 * sigmaX), face.width);
+	int halfHeight = std::min((int)(face.height * 0.6f + 3 * sigmaY), face.height);
+	cv::Rect roi((int)x - halfWidth, (int)y - halfHeight, 2 * halfWidth, 2 * halfHeight);
+	roi &= cv::Rect(0, 0, frame.cols, frame.rows);
+
+	// Template matching needs at least the template
+	if (roi.width < m_faceTemplate[slot].cols || roi.height < m_faceTemplate[slot].rows)
+		return doubleRectSize(face, cv::Rect(0, 0, frame.cols, frame.rows));
+	return roi;
+}
+
+/*
+* Slot of the track the rect overlaps, or -1.
+*/
+int Detect_Recognize::trackAround(const cv::Rect &rect) const
+{
+	for (int slot : m_activeSlots)
 	{
-		if (!isAround(allFaces[i]))
+		cv::Point centerFace, centerRect;
+		centerFace = centerOfRect(m_trackedFace[slot]);
+		centerRect = centerOfRect(rect);
+		if (abs(centerFace.x - centerRect.x) < ((m_trackedFace[slot].width + rect.width)/ 2))
 		{
-			m_trackedFace.push_back(allFaces[i]);
-			// Copy face template
-			m_faceTemplate.push_back(getFaceTemplate(frame, allFaces[i]));
+			if (abs(centerFace.y - centerRect.y) < ((m_trackedFace[slot].height + rect.height) / 2))
+			{
+				return slot;
+			}
+		}
+	}
+	return -1;
+}
 
-			// Calculate roi
-			m_faceRoi.push_back(doubleRectSize(allFaces[i], cv::Rect(0, 0, frame.cols, frame.rows)));
+/*
+* New detections revive the lost track they overlap or open a new one;
+* detections of faces already tracked are ignored.
+*/
+void Detect_Recognize::addDetections(const cv::Mat &frame, const std::vector<cv::Rect> &faces, const std::vector<double> &confidences)
+{
+	for (size_t i = 0; i < faces.size(); i++)
+	{
+		int slot = trackAround(faces[i]);
+		if (slot < 0)
+			openTrack(frame, faces[i], confidences[i]);
+		else if (m_trackState[slot] == TRACK_LOST) {
+			setTrackFace(frame, slot, faces[i], confidences[i]);
+			resetMotion(slot);
+		}
+	}
+	m_faceNum = faceNumVisible();
+}
 
-			// Update face position
-			m_facePosition.push_back(centerOfRect(allFaces[i]));
+int Detect_Recognize::faceNumVisible() const
+{
+	int count = 0;
+	for (int slot : m_activeSlots)
+	{
+		if (m_trackState[slot] != TRACK_LOST)
+			count++;
+	}
+	return count;
+}
 
-			m_templateMatchingCurrentTime.push_back(0);
-			m_templateMatchingStartTime.push_back(0);
-		}
+void Detect_Recognize::detectFacesOther(const cv::Mat &frame, const cv::Rect &area)
+{
+	if (m_motionGating) {
+		detectFacesInMotion(frame, area);
+		return;
+	}
+
+	// Minimum face size is 1/5th of screen height
+	// Maximum face size is 2/3rds of screen height
+	scanArea(frame, area, frame.rows / 5, frame.rows * 2 / 3);
+}
+
+/*
+* Cascade search of area for faces from minSize to maxSize, capped by the
+* searched area.
+*/
+void Detect_Recognize::scanArea(const cv::Mat &frame, const cv::Rect &area, int minSize, int maxSize)
+{
+	std::vector<cv::Rect>   allFaces;
+	std::vector<double>     confidences;
+	maxSize = std::min(maxSize, std::min(area.width, area.height));
+	if (maxSize < minSize) return;
+
+	detectWithConfidence(frame(area), allFaces, confidences,
+		cv::Size(minSize, minSize),
+		cv::Size(maxSize, maxSize));
+
+	// Back to frame coordinates
+	for (auto &face : allFaces) {
+		face.x += area.x;
+		face.y += area.y;
 	}
-	m_faceNum = m_trackedFace.size();
+
+	addDetections(frame, allFaces, confidences);
 }
 
 void Detect_Recognize::getFrameAndDetect(cv::Mat &frame)
@@ -373,27 +1279,257 @@ void Detect_Recognize::getFrameAndDetect(cv::Mat &frame)
 	cv::Size resizedFrameSize = cv::Size((int)(m_scale*frame.cols), (int)(m_scale*frame.rows));
 
 	cv::resize(frame, resizedFrame, resizedFrameSize);
+	cv::cvtColor(resizedFrame, m_gray, cv::COLOR_BGR2GRAY);
+	updateMotion();
+	// The rescan schedule counts frames, keyframes or not
+	m_framesSinceRescan++;
+	m_framesSinceBand++;
+
+	// Retire the stale lost tracks, place the roi of all others; between
+	// keyframes the trackers alone move the faces
+	m_roiArea = 0;
+	m_roiPasses = 0;
+	m_trackerTime = 0;
+	int64 now = cv::getTickCount();
+	bool keyframe = isKeyframe();
+	std::vector<int> searched;
+	for (size_t a = 0; a < m_activeSlots.size();) {
+		int slot = m_activeSlots[a];
+		if (m_trackState[slot] == TRACK_LOST) {
+			if ((now - m_lostTime[slot]) / TICK_FREQUENCY > m_lostRetention) {
+				retireTrack(slot);
+				continue;
+			}
+		}
+		else {
+			// Both the cascade and template matching look in the predicted roi
+			if (m_motionModel == MOTION_KALMAN)
+				m_faceRoi[slot] = predictRoi(resizedFrame, slot);
+			if (keyframe) {
+				m_roiArea += m_faceRoi[slot].area();
+				searched.push_back(slot);
+			}
+			else {
+				interpolateTrack(resizedFrame, slot);
+			}
+		}
+		a++;
+	}
 
-	if (!m_foundFace) {
+	if (!keyframe) {
+		m_framesSinceKeyframe++;
+		m_keyframeStats.interpolatedFrames++;
+		m_faceNum = faceNumVisible();
+		m_lastRoiArea = 0;
+		m_lastRoiPasses = 0;
+		m_lastTrackerTime = m_trackerTime;
+		return;
+	}
+	m_framesSinceKeyframe = 0;
+	m_forceKeyframe = false;
+	m_keyframeStats.keyframes++;
+
+	// Detect using cascades only in the rois, then advance every track
+	std::vector<cv::Rect> faces;
+	std::vector<double> confidences;
+	detectFacesAroundRois(resizedFrame, searched, faces, confidences);
+	for (size_t k = 0; k < searched.size(); k++)
+		updateTrack(resizedFrame, searched[k], faces[k], confidences[k], now);
+	m_faceNum = faceNumVisible();
+	m_lastRoiArea = m_roiArea;
+	m_lastRoiPasses = m_roiPasses;
+	m_lastTrackerTime = m_trackerTime;
+
+	if (m_faceNum == 0) {
 		detectFaceAllSizes(resizedFrame); // Detect using cascades over whole image
-		flag = false;
+		// A full-frame scan just ran, restart the rescan schedule
+		m_StartTime = cv::getTickCount();
+		m_framesSinceRescan = 0;
+		m_framesSinceBand = 0;
 	}		
 	else {
-		if (flag == false)
-		{
-			m_StartTime = cv::getTickCount();
-			flag = true;
+		rescan(resizedFrame); // Look for new faces as scheduled
+	}
+	updateKeyframeInterval();
+}
+
+void Detect_Recognize::setRescanSchedule(const int mode, const double period, const int bands)
+{
+	m_schedule.mode = std::min(std::max(mode, (int)RESCAN_FRAMES), (int)RESCAN_BANDS);
+	m_schedule.period = std::max(period, 1.0);
+	m_schedule.bands = std::max(bands, 1);
+	m_nextBand = 0;
+}
+
+Detect_Recognize::ScanSchedule Detect_Recognize::rescanSchedule() const
+{
+	return m_schedule;
+}
+
+void Detect_Recognize::setMotionGating(const bool enabled, const int refreshFrames)
+{
+	m_motionGating = enabled;
+	m_motionRefresh = std::max(refreshFrames, 1);
+	m_background.release();
+	m_motionBoxes.clear();
+}
+
+bool Detect_Recognize::motionGating() const
+{
+	return m_motionGating;
+}
+
+Detect_Recognize::MotionStats Detect_Recognize::motionStats() const
+{
+	return m_motionStats;
+}
+
+/*
+* Quarter resolution frame difference against a running-average
+* background; the changed boxes are kept in frame coordinates. The first
+* frame has no background yet and asks for a full scan.
+*/
+void Detect_Recognize::updateMotion()
+{
+	m_motionBoxes.clear();
+	if (!m_motionGating)
+		return;
+	m_framesSinceRefresh++;
+
+	cv::pyrDown(m_gray, m_motionSmall);
+	cv::pyrDown(m_motionSmall, m_motionSmall);
+	if (m_background.size() != m_motionSmall.size()) {
+		m_motionSmall.convertTo(m_background, CV_32F);
+		m_framesSinceRefresh = m_motionRefresh;
+		return;
+	}
+
+	m_background.convertTo(m_motionMask, CV_8U);
+	cv::absdiff(m_motionSmall, m_motionMask, m_motionMask);
+	cv::threshold(m_motionMask, m_motionMask, MOTION_THRESHOLD, 255, cv::THRESH_BINARY);
+	cv::accumulateWeighted(m_motionSmall, m_background, BACKGROUND_RATE);
+
+	std::vector<std::vector<cv::Point> > contours;
+	cv::findContours(m_motionMask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+	double scale = (double)m_gray.cols / m_motionSmall.cols;
+	for (const auto &contour : contours) {
+		cv::Rect box = cv::boundingRect(contour);
+		if (box.area() < MIN_MOTION_AREA)
+			continue;
+		m_motionBoxes.push_back(cv::Rect(cvFloor(box.x * scale), cvFloor(box.y * scale),
+			cvCeil(box.width * scale), cvCeil(box.height * scale)));
+	}
+}
+
+/*
+* Changed boxes grown by margin and cut to area, overlapping ones merged
+* into their union.
+*/
+void Detect_Recognize::motionRegions(const cv::Rect &area, int margin, std::vector<cv::Rect> &regions) const
+{
+	regions.clear();
+	for (const cv::Rect &box : m_motionBoxes) {
+		cv::Rect grown = cv::Rect(box.x - margin, box.y - margin, box.width + 2 * margin, box.height + 2 * margin) & area;
+		if (grown.area() > 0)
+			regions.push_back(grown);
+	}
+	for (bool merged = true; merged;) {
+		merged = false;
+		for (size_t i = 0; i < regions.size() && !merged; i++) {
+			for (size_t j = i + 1; j < regions.size() && !merged; j++) {
+				if ((regions[i] & regions[j]).area() > 0) {
+					regions[i] |= regions[j];
+					regions.erase(regions.begin() + j);
+					merged = true;
+				}
+			}
 		}
-		detectFaceAroundRoi(resizedFrame); // Detect using cascades only in ROI
-		if (m_templateMatchingRunning) {
-			detectFacesTemplateMatching(resizedFrame); // Detect using template matching
+	}
+}
+
+/*
+* Discovery limited to what changed: a face of size s that overlaps a
+* changed box lies within s of it. The face sizes are searched in octave
+* passes, each around the boxes grown by the largest size of its pass, so
+* only the few large windows see the wide regions. Every m_motionRefresh
+* frames the whole frame is scanned instead, for faces that stopped
+* moving. A pass over an area counts by its share of the windows of a
+* full-frame scan, about 1/s^2 per scale for faces of size s.
+*/
+void Detect_Recognize::detectFacesInMotion(const cv::Mat &frame, const cv::Rect &area)
+{
+	int minSize = frame.rows / 5, maxSize = frame.rows * 2 / 3;
+	cv::Rect full(0, 0, frame.cols, frame.rows);
+	double scanned = 0;
+	m_motionStats.scans++;
+
+	if (m_framesSinceRefresh >= m_motionRefresh) {
+		m_framesSinceRefresh = 0;
+		m_motionStats.refreshScans++;
+		scanArea(frame, full, minSize, maxSize);
+		scanned = full.area();
+	}
+	else if (m_motionBoxes.empty()) {
+		m_motionStats.emptyScans++;
+	}
+	else {
+		std::vector<cv::Rect> regions;
+		double windows = 1.0 / ((double)minSize * minSize) - 1.0 / ((double)maxSize * maxSize);
+		for (int lower = minSize; lower < maxSize;) {
+			int upper = std::min(2 * lower, maxSize);
+			double share = (1.0 / ((double)lower * lower) - 1.0 / ((double)upper * upper)) / windows;
+			motionRegions(area, upper, regions);
+			for (const cv::Rect &region : regions) {
+				scanArea(frame, region, lower, upper);
+				scanned += share * region.area();
+			}
+			lower = upper;
 		}
-		m_CurrentTime = cv::getTickCount();
-		if ((m_CurrentTime - m_StartTime) > 10)
-		{
-			//m_foundFace = false;
-			detectFacesOther(resizedFrame);
-			flag = false;
+	}
+
+	m_motionStats.scannedPercent = 100.0 * scanned / std::max(full.area(), 1);
+	m_motionStats.scannedPercentSum += m_motionStats.scannedPercent;
+}
+
+/*
+* Runs on keyframes only. The band sweep catches up on the frames since
+* the last rescan, so a keyframe interval of n searches n bands at once
+* and a sweep still takes bands frames.
+*/
+void Detect_Recognize::rescan(const cv::Mat &frame)
+{
+	m_CurrentTime = cv::getTickCount();
+
+	bool due;
+	if (m_schedule.mode == RESCAN_MILLISECONDS)
+		due = (m_CurrentTime - m_StartTime) * 1000.0 / TICK_FREQUENCY >= m_schedule.period;
+	else
+		due = m_framesSinceRescan >= m_schedule.period;
+
+	if (due) {
+		detectFacesOther(frame, cv::Rect(0, 0, frame.cols, frame.rows));
+		m_StartTime = m_CurrentTime;
+		m_framesSinceRescan = 0;
+		m_framesSinceBand = 0;
+		m_schedule.fullScans++;
+		return;
+	}
+
+	if (m_schedule.mode == RESCAN_BANDS && m_schedule.bands > 1) {
+		// Bands overlap by the minimum face size; consecutive bands are
+		// searched as one area, split where the sweep wraps around
+		int count = std::min(m_framesSinceBand, m_schedule.bands);
+		m_framesSinceBand = 0;
+		int stride = frame.rows / m_schedule.bands;
+		while (count > 0) {
+			int band = m_nextBand;
+			int run = std::min(count, m_schedule.bands - band);
+			m_nextBand = (band + run) % m_schedule.bands;
+			count -= run;
+			int top = band * stride;
+			int bottom = std::min(frame.rows, (band + run) * stride + frame.rows / 5);
+			detectFacesOther(frame, cv::Rect(0, top, frame.cols, bottom - top));
+			m_schedule.bandScans += run;
 		}
 	}
 }
@@ -410,19 +1546,25 @@ void Detect_Recognize::Detect_and_Recognize(cv::Mat &frame)
 	cv::Mat gray, m_res;
 	cv::Size ResImgSiz = cv::Size(100, 100);
 	Test.clear();
-	for (int i = 0; i < m_trackedFace.size(); i++)
+	for (size_t a = 0; a < m_activeSlots.size();)
 	{
-		cv::cvtColor(resizedFrame(m_trackedFace[i]), gray, cv::COLOR_BGR2GRAY);
-		if (gray.rows == 0 || gray.cols == 0)
+		int slot = m_activeSlots[a];
+		if (m_trackState[slot] == TRACK_LOST)
+		{
+			a++;
+			continue;
+		}
+		if (m_trackedFace[slot].area() == 0)
 		{
-			m_trackedFace.erase(m_trackedFace.begin()+i);
-			i = i - 1;
+			retireTrack(slot);
 			continue;
 		}
+		cv::cvtColor(resizedFrame(m_trackedFace[slot]), gray, cv::COLOR_BGR2GRAY);
 		cv::resize(gray, m_res, ResImgSiz, CV_INTER_NN);
 		//cv::imshow("result", m_res);
 		//cv::imwrite("../15.jpg", m_res);
-		Test.push_back(m_res);
+		Test.push_back(m_res.clone());
+		a++;
 	}
 	m_faceNum = Test.size();
 }
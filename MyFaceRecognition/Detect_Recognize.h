@@ -3,10 +3,76 @@
 #include <opencv2\core.hpp>
 #include <opencv2\highgui\highgui.hpp>
 #include <opencv2\objdetect\objdetect.hpp>
+#include <opencv2\video\tracking.hpp>
+#include "FaceTracker.h"
 
 class Detect_Recognize 
 {
 public:
+	// When the whole frame is searched for faces that are not tracked yet
+	enum RescanMode {
+		RESCAN_FRAMES = 0,			// full-frame scan every period frames
+		RESCAN_MILLISECONDS = 1,	// full-frame scan every period milliseconds
+		RESCAN_BANDS = 2			// one horizontal band per frame, full-frame scan every period frames
+	};
+
+	// Life cycle of a track slot
+	enum TrackState {
+		TRACK_FREE = 0,			// slot on the free-list
+		TRACK_DETECTED = 1,		// found by the cascade in its roi
+		TRACK_TEMPLATE = 2,		// followed by the tracker backend or template matching
+		TRACK_LOST = 3			// kept a while so a new detection can revive it
+	};
+
+	// How the search roi of a tracked face is placed
+	enum MotionModel {
+		MOTION_NONE = 0,	// twice the face size around the last position
+		MOTION_KALMAN = 1	// constant-velocity Kalman prediction, sized by its uncertainty
+	};
+
+	// How a track is followed while the cascade misses it
+	enum TrackerBackend {
+		TRACKER_TEMPLATE = 0,		// template matching only
+		TRACKER_OPTICAL_FLOW = 1,	// pyramidal Lucas-Kanade on face corners
+		TRACKER_CORRELATION = 2		// MOSSE correlation filter
+	};
+
+	// How far apart the frames are on which the cascade runs
+	enum KeyframeMode {
+		KEYFRAME_FIXED = 0,		// every interval frames
+		KEYFRAME_ADAPTIVE = 1	// up to interval frames, fewer while faces move fast
+	};
+
+	// Interpolated tracks checked against the cascade on the next keyframe
+	struct KeyframeStats
+	{
+		size_t				keyframes = 0;
+		size_t				interpolatedFrames = 0;
+		size_t				verified = 0;		// found by the cascade
+		size_t				missed = 0;			// not found by the cascade
+		size_t				drifted = 0;		// found, overlap (IoU) below 0.5
+		double				overlapSum = 0;		// IoU summed over the verified tracks
+	};
+
+	// Discovery scans limited to the changed parts of the frame
+	struct MotionStats
+	{
+		size_t				scans = 0;
+		size_t				emptyScans = 0;		// skipped, nothing changed
+		size_t				refreshScans = 0;	// full frame, for faces that stopped moving
+		double				scannedPercent = 0;	// cascade windows of the last scan, percent of a full-frame scan
+		double				scannedPercentSum = 0;
+	};
+
+	struct ScanSchedule
+	{
+		int					mode = RESCAN_BANDS;
+		double				period = 30;
+		int					bands = 4;
+		size_t				fullScans = 0;
+		size_t				bandScans = 0;
+	};
+
 	Detect_Recognize(const std::string cascadeFilePath, cv::VideoCapture &videoCapture);
 	~Detect_Recognize();
 
@@ -29,43 +95,201 @@ public:
 	void                    setTemplateMatchingMaxDuration(const double s);
 	double                  templateMatchingMaxDuration() const;
 	int						faceNum() const;
+	// Face rect of every tracked face before it was clamped to the frame,
+	// in the order of face(); it reaches outside the frame when the face
+	// leaves it
+	std::vector<cv::Rect>   faceExtent() const;
+	// Stable id of every tracked face, in the order of face()
+	std::vector<int>		trackIds() const;
+	// Ids of all tracks not retired yet, lost ones included; a lost track
+	// revived by a detection comes back with the same id
+	std::vector<int>		liveTrackIds() const;
+	// Cascade level weight of the last detection of every tracked face
+	std::vector<double>		faceConfidence() const;
+	// TrackState of every tracked face
+	std::vector<int>		trackStates() const;
+	// Size of the track table; new detections beyond it are dropped
+	void					setTrackCapacity(const int capacity);
+	int						trackCapacity() const;
+	// Seconds a lost track is kept before it is retired
+	void					setLostRetention(const double s);
+	double					lostRetention() const;
+	size_t					retiredTracks() const;
+	size_t					droppedDetections() const;
+	void					setMotionModel(const int model);
+	int						motionModel() const;
+	// Pixels of the resized frame searched around the tracks last frame
+	double					roiAreaPerFrame() const;
+	// Packs all track rois into one mosaic for a single cascade pass
+	void					setRoiConsolidation(const bool enabled);
+	bool					roiConsolidation() const;
+	// detectMultiScale calls spent on the track rois last frame
+	int						roiPassesPerFrame() const;
+	// Number of scales (0 to 3) at which a tracked face is confirmed in its
+	// roi; 0 runs a regular multi-scale search for sizes +/-20% instead
+	void					setConfirmationScales(const int scales);
+	int						confirmationScales() const;
+	// TRACKER_TEMPLATE by default; template matching stays the fallback
+	// when the backend loses a face
+	void					setTrackerBackend(const int backend);
+	int						trackerBackend() const;
+	// Milliseconds per frame for all tracker updates; tracks beyond it keep
+	// their last position for the frame
+	void					setTrackerBudget(const double ms);
+	double					trackerBudget() const;
+	double					trackerTimePerFrame() const;
+	size_t					trackerFallbacks() const;
+	size_t					trackerSkips() const;
+	// The cascade runs on keyframes only; the frames in between are served
+	// by the tracker backend (or template matching) alone
+	void					setKeyframeInterval(const int frames, const int mode = KEYFRAME_FIXED);
+	int						keyframeInterval() const;
+	int						keyframeMode() const;
+	int						currentKeyframeInterval() const;
+	KeyframeStats			keyframeStats() const;
+	// Confidence in [0, 1] of the position of every tracked face; 1 for a
+	// cascade detection
+	std::vector<double>		trackingConfidence() const;
+	// Full-frame and band scans only search around what changed against a
+	// background model, plus a full scan every refreshFrames frames
+	void					setMotionGating(const bool enabled, const int refreshFrames = 90);
+	bool					motionGating() const;
+	MotionStats				motionStats() const;
 	std::vector<cv::Mat>	TestFaces() const;
+	// Overlapping bands let faces up to 1/5th of the frame height cross a
+	// band border; larger new faces wait for the next full-frame scan
+	void					setRescanSchedule(const int mode, const double period, const int bands = 4);
+	ScanSchedule			rescanSchedule() const;
+	// Splits large searches into overlapping tiles for the small face
+	// sizes plus one coarse pass for the large ones, run in parallel with
+	// one cascade per thread and merged by non-maximum suppression
+	void					setTiledDetection(const bool enabled);
+	bool					tiledDetection() const;
 
 private:
 	static const double     TICK_FREQUENCY;
+	static const int		MIN_PYRAMID_TEMPLATE;
+	static const int		REFINE_RADIUS;
+	static const double		MAX_KEYFRAME_DRIFT;
+	static const double		MIN_INTERPOLATION_CONFIDENCE;
+	static const double		MOTION_THRESHOLD;
+	static const double		BACKGROUND_RATE;
+	static const int		MIN_MOTION_AREA;
+	static const double		CONFIRMATION_STEP;
 
 	cv::VideoCapture*       m_videoCapture = NULL;
 	cv::CascadeClassifier*  m_faceCascade = NULL;
+	std::string				m_cascadeFilePath;
+	bool					m_tiledDetection = true;
+	std::vector<cv::Ptr<cv::CascadeClassifier> >	m_tileCascades;
 	std::vector<cv::Rect>   m_allFaces;
+	// Track table, one entry per slot in every vector below; slots are
+	// taken from and returned to m_freeSlots
+	std::vector<int>		m_trackState;
+	std::vector<int64>		m_lostTime;
+	std::vector<int>		m_freeSlots;
+	std::vector<int>		m_activeSlots;
+	double					m_lostRetention = 1;
+	size_t					m_retiredTracks = 0;
+	size_t					m_droppedDetections = 0;
+	std::vector<cv::KalmanFilter>	m_kalman;
+	std::vector<cv::Ptr<FaceTracker> >	m_tracker;
+	int						m_trackerBackend = TRACKER_TEMPLATE;
+	double					m_trackerBudget = 10;
+	double					m_trackerTime = 0;
+	double					m_lastTrackerTime = 0;
+	size_t					m_trackerFallbacks = 0;
+	size_t					m_trackerSkips = 0;
+	cv::Mat					m_gray;			// resizedFrame in grayscale
+	std::vector<double>		m_trackingConfidence;
+	std::vector<int>		m_interpolated;	// moved by interpolation since the last keyframe
+	int						m_keyframeInterval = 1;
+	int						m_keyframeMode = KEYFRAME_FIXED;
+	int						m_currentKeyframeInterval = 1;
+	int						m_framesSinceKeyframe = 0;
+	bool					m_forceKeyframe = false;
+	KeyframeStats			m_keyframeStats;
+	bool					m_motionGating = false;
+	int						m_motionRefresh = 90;
+	int						m_framesSinceRefresh = 0;
+	cv::Mat					m_motionSmall;
+	cv::Mat					m_motionMask;
+	cv::Mat					m_background;	// CV_32F, quarter resolution
+	std::vector<cv::Rect>	m_motionBoxes;	// changed boxes of this frame
+	MotionStats				m_motionStats;
+	int						m_motionModel = MOTION_KALMAN;
+	int64					m_roiArea = 0;
+	int64					m_lastRoiArea = 0;
+	bool					m_roiConsolidation = true;
+	int						m_roiPasses = 0;
+	int						m_lastRoiPasses = 0;
+	int						m_confirmationScales = 3;
 	//cv::Rect                m_trackedFace;
 	std::vector<cv::Rect>   m_trackedFace;
+	std::vector<cv::Rect>   m_faceExtent;	// m_trackedFace before clamping
 	//cv::Rect                m_faceRoi;
 	std::vector<cv::Rect>   m_faceRoi;
 	//cv::Mat                 m_faceTemplate;
 	std::vector<cv::Mat>	m_faceTemplate;
-	cv::Mat                 m_matchingResult;
-	bool                    m_templateMatchingRunning = false;
+	std::vector<cv::Mat>	m_smallTemplate;
+	// Per-track storage behind the templates and the matching scratch
+	std::vector<cv::Mat>	m_templateBuffer;
+	std::vector<cv::Mat>	m_smallTemplateBuffer;
+	std::vector<cv::Mat>	m_smallRoiBuffer;
+	std::vector<cv::Mat>	m_matchingBuffer;
 	std::vector<int64>      m_templateMatchingStartTime;
 	std::vector<int64>      m_templateMatchingCurrentTime;
-	bool                    m_foundFace = false;
 	double                  m_scale;
 	int                     m_resizedWidth = 320;
 	std::vector<cv::Point>  m_facePosition;
+	std::vector<int>		m_trackId;
+	std::vector<double>		m_faceConfidence;
+	int						m_nextTrackId = 0;
 	double                  m_templateMatchingMaxDuration = 3;
 	size_t					m_faceNum = 0;
 	int64                   m_StartTime = 0;
 	int64                   m_CurrentTime = 0;
-	bool					flag = false;
+	ScanSchedule			m_schedule;
+	int						m_framesSinceRescan = 0;
+	int						m_framesSinceBand = 0;	// bands owed to the sweep
+	int						m_nextBand = 0;
 	cv::Mat                 resizedFrame;
 	std::vector<cv::Mat>	Test;
 
 	cv::Rect    doubleRectSize(const cv::Rect &inputRect, const cv::Rect &frameSize) const;
 	cv::Rect    biggestFace(std::vector<cv::Rect> &faces) const;
 	cv::Point   centerOfRect(const cv::Rect &rect) const;
-	cv::Mat     getFaceTemplate(const cv::Mat &frame, cv::Rect face);
+	void        storeFaceTemplate(int slot, cv::Rect face);
+	void        detectWithConfidence(const cv::Mat &frame, std::vector<cv::Rect> &faces, std::vector<double> &confidences,
+					const cv::Size &minSize, const cv::Size &maxSize);
+	void        detectAtScales(const cv::Mat &image, const cv::Size &face, std::vector<cv::Rect> &faces, std::vector<double> &confidences);
+	bool        detectTiled(const cv::Mat &frame, std::vector<cv::Rect> &faces, std::vector<double> &confidences,
+					const cv::Size &minSize, const cv::Size &maxSize);
 	void        detectFaceAllSizes(const cv::Mat &frame);
-	void        detectFaceAroundRoi(const cv::Mat &frame);
-	void        detectFacesTemplateMatching(const cv::Mat &frame);
-	void        detectFacesOther(const cv::Mat &frame);
-	bool		isAround(const cv::Rect &rect) const;
+	bool        detectFaceAroundRoi(const cv::Mat &frame, int slot, cv::Rect &face, double &confidence);
+	void        detectFacesAroundRois(const cv::Mat &frame, const std::vector<int> &slots,
+					std::vector<cv::Rect> &faces, std::vector<double> &confidences);
+	bool        detectFacesTemplateMatching(const cv::Mat &frame, int slot);
+	void        detectFacesOther(const cv::Mat &frame, const cv::Rect &area);
+	void        scanArea(const cv::Mat &frame, const cv::Rect &area, int minSize, int maxSize);
+	void        updateMotion();
+	void        motionRegions(const cv::Rect &area, int margin, std::vector<cv::Rect> &regions) const;
+	void        detectFacesInMotion(const cv::Mat &frame, const cv::Rect &area);
+	void        rescan(const cv::Mat &frame);
+	int         openTrack(const cv::Mat &frame, const cv::Rect &face, double confidence);
+	void        retireTrack(int slot);
+	void        setTrackFace(const cv::Mat &frame, int slot, const cv::Rect &face, double confidence);
+	void        createTrackers();
+	bool        followTrack(const cv::Mat &frame, int slot);
+	bool        isKeyframe() const;
+	void        updateKeyframeInterval();
+	void        interpolateTrack(const cv::Mat &frame, int slot);
+	void        verifyInterpolation(int slot, const cv::Rect &face);
+	void        updateTrack(const cv::Mat &frame, int slot, const cv::Rect &face, double confidence, int64 now);
+	void        addDetections(const cv::Mat &frame, const std::vector<cv::Rect> &faces, const std::vector<double> &confidences);
+	int         trackAround(const cv::Rect &rect) const;
+	int         faceNumVisible() const;
+	void        resetMotion(int slot);
+	void        correctMotion(int slot);
+	cv::Rect    predictRoi(const cv::Mat &frame, int slot);
 };
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "FaceQuality.h"
+#include <opencv2\imgproc.hpp>
+#include <algorithm>
+
+// Crops are scaled to this width before the Laplacian, which keeps the
+// sharpness comparable across face sizes and the cost constant
+const int FaceQuality::SHARPNESS_SIZE = 64;
+
+FaceQuality::FaceQuality() :
+	m_skipped(REASON_COUNT, 0)
+{
+}
+
+void FaceQuality::setMinSize(const int pixels)
+{
+	m_minSize = std::max(pixels, 0);
+}
+
+int FaceQuality::minSize() const
+{
+	return m_minSize;
+}
+
+void FaceQuality::setMaxClipping(const double fraction)
+{
+	m_maxClipping = std::min(std::max(fraction, 0.0), 1.0);
+}
+
+double FaceQuality::maxClipping() const
+{
+	return m_maxClipping;
+}
+
+void FaceQuality::setMinSharpness(const double variance)
+{
+	m_minSharpness = variance;
+}
+
+double FaceQuality::minSharpness() const
+{
+	return m_minSharpness;
+}
+
+void FaceQuality::setMinConfidence(const double confidence)
+{
+	m_minConfidence = confidence;
+}
+
+double FaceQuality::minConfidence() const
+{
+	return m_minConfidence;
+}
+
+size_t FaceQuality::checked() const
+{
+	return m_checked;
+}
+
+size_t FaceQuality::skipped(const int reason) const
+{
+	return (reason >= 0 && reason < REASON_COUNT) ? m_skipped[reason] : 0;
+}
+
+double FaceQuality::lastSharpness() const
+{
+	return m_lastSharpness;
+}
+
+void FaceQuality::resetCounters()
+{
+	m_checked = 0;
+	m_skipped.assign(REASON_COUNT, 0);
+}
+
+const char *FaceQuality::reasonName(const int reason)
+{
+	static const char *names[REASON_COUNT] = { "accepted", "too small", "clipped", "low confidence", "blurry" };
+	return (reason >= 0 && reason < REASON_COUNT) ? names[reason] : "unknown";
+}
+
+int FaceQuality::reject(const int reason)
+{
+	m_skipped[reason]++;
+	return reason;
+}
+
+int FaceQuality::check(const cv::Mat &gray, const cv::Rect &face, const cv::Size &frameSize, double confidence)
+{
+	m_checked++;
+
+	cv::Rect visible = face & cv::Rect(0, 0, frameSize.width, frameSize.height);
+	if (std::min(visible.width, visible.height) < m_minSize || gray.empty())
+		return reject(TOO_SMALL);
+
+	double clipped = 1.0 - (double)visible.area() / std::max((double)face.area(), 1.0);
+	if (clipped > m_maxClipping)
+		return reject(CLIPPED);
+
+	if (confidence < m_minConfidence)
+		return reject(LOW_CONFIDENCE);
+
+	int height = std::max(1, gray.rows * SHARPNESS_SIZE / std::max(gray.cols, 1));
+	cv::resize(gray, m_small, cv::Size(SHARPNESS_SIZE, height), 0, 0, cv::INTER_AREA);
+	cv::Laplacian(m_small, m_laplacian, CV_16S);
+	cv::Scalar mean, stddev;
+	cv::meanStdDev(m_laplacian, mean, stddev);
+	m_lastSharpness = stddev[0] * stddev[0];
+	if (m_lastSharpness < m_minSharpness)
+		return reject(BLURRY);
+
+	return ACCEPTED;
+}
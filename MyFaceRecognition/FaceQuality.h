@@ -0,0 +1,64 @@
+#pragma once
+
+#include <opencv2\core.hpp>
+#include <cfloat>
+#include <vector>
+
+// Cheap quality gate for face crops, run before descriptor extraction so
+// blurry, tiny, clipped or weakly detected faces don't cost a gallery
+// scan. Checks run cheapest first and stop at the first failure; every
+// rejection is counted per reason.
+class FaceQuality
+{
+public:
+	enum Reason {
+		ACCEPTED = 0,
+		TOO_SMALL,			// shorter visible side below the minimum size
+		CLIPPED,			// too much of the face outside the frame
+		LOW_CONFIDENCE,		// weak cascade response
+		BLURRY,				// low variance of the Laplacian
+		REASON_COUNT
+	};
+
+	FaceQuality();
+
+	// Rates the crop of face in a frame of frameSize. face is in frame
+	// coordinates and not clamped, so it may reach outside the frame; gray
+	// is the grayscale crop of its visible part, confidence the cascade
+	// level weight of the detection if there is one.
+	int						check(const cv::Mat &gray, const cv::Rect &face, const cv::Size &frameSize,
+								double confidence = DBL_MAX);
+
+	void					setMinSize(const int pixels);
+	int						minSize() const;
+	// Largest fraction of the face allowed outside the frame
+	void					setMaxClipping(const double fraction);
+	double					maxClipping() const;
+	// Variance of the Laplacian of the crop scaled to SHARPNESS_SIZE
+	void					setMinSharpness(const double variance);
+	double					minSharpness() const;
+	void					setMinConfidence(const double confidence);
+	double					minConfidence() const;
+
+	size_t					checked() const;
+	size_t					skipped(const int reason) const;
+	double					lastSharpness() const;
+	void					resetCounters();
+
+	static const char*		reasonName(const int reason);
+
+private:
+	static const int		SHARPNESS_SIZE;
+
+	int						m_minSize = 40;
+	double					m_maxClipping = 0.25;
+	double					m_minSharpness = 20;
+	double					m_minConfidence = -DBL_MAX;
+	size_t					m_checked = 0;
+	std::vector<size_t>		m_skipped;
+	double					m_lastSharpness = 0;
+	cv::Mat					m_small;
+	cv::Mat					m_laplacian;
+
+	int			reject(const int reason);
+};
\ No newline at end of file
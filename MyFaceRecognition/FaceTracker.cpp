@@ -0,0 +1,216 @@
+#include "FaceTracker.h"
+#include <opencv2\imgproc.hpp>
+#include <opencv2\video\tracking.hpp>
+#include <algorithm>
+#include <cmath>
+
+// Fewer surviving points than this and the track is lost
+const int OpticalFlowTracker::MIN_POINTS = 4;
+// The filter window covers this multiple of the face
+const double CorrelationTracker::PADDING = 1.5;
+// Width of the desired response peak, in window pixels
+const double CorrelationTracker::SIGMA = 2.0;
+
+namespace
+{
+	float median(std::vector<float> &values)
+	{
+		std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+		return values[values.size() / 2];
+	}
+}
+
+OpticalFlowTracker::OpticalFlowTracker(int maxPoints, int levels) :
+	m_maxPoints(std::max(maxPoints, MIN_POINTS)),
+	m_levels(std::max(levels, 0))
+{
+}
+
+void OpticalFlowTracker::init(const cv::Mat &gray, const cv::Rect &face)
+{
+	cv::Rect frame(0, 0, gray.cols, gray.rows);
+	m_face = face & frame;
+	m_region = cv::Rect(face.x - face.width / 2, face.y - face.height / 2, face.width * 2, face.height * 2) & frame;
+	m_points.clear();
+	if (m_face.area() == 0)
+		return;
+	gray(m_region).copyTo(m_prev);
+
+	// Corners inside the face, in region coordinates
+	cv::Rect inner = m_face - m_region.tl();
+	cv::goodFeaturesToTrack(m_prev(inner), m_points, m_maxPoints, 0.01, std::max(inner.width / 10, 1));
+	for (cv::Point2f &p : m_points)
+		p += cv::Point2f((float)inner.x, (float)inner.y);
+}
+
+double OpticalFlowTracker::confidence() const
+{
+	return m_confidence;
+}
+
+bool OpticalFlowTracker::update(const cv::Mat &gray, cv::Rect &face)
+{
+	if ((int)m_points.size() < MIN_POINTS || m_region.br().x > gray.cols || m_region.br().y > gray.rows)
+		return false;
+
+	cv::Mat next = gray(m_region);
+	cv::Size window(11, 11);
+	cv::calcOpticalFlowPyrLK(m_prev, next, m_points, m_next, m_status, m_error, window, m_levels);
+	cv::calcOpticalFlowPyrLK(next, m_prev, m_next, m_back, m_backStatus, m_error, window, m_levels);
+
+	std::vector<int> kept;
+	std::vector<float> dx, dy;
+	for (size_t i = 0; i < m_points.size(); i++) {
+		cv::Point2f d = m_back[i] - m_points[i];
+		if (m_status[i] && m_backStatus[i] && d.dot(d) < 1.f) {
+			kept.push_back((int)i);
+			dx.push_back(m_next[i].x - m_points[i].x);
+			dy.push_back(m_next[i].y - m_points[i].y);
+		}
+	}
+	if ((int)kept.size() < MIN_POINTS)
+		return false;
+	m_confidence = (double)kept.size() / m_points.size();
+
+	// Scale change from the pairwise point distances
+	std::vector<float> ratios;
+	for (size_t i = 0; i < kept.size(); i++) {
+		for (size_t j = i + 1; j < kept.size(); j++) {
+			double before = cv::norm(m_points[kept[i]] - m_points[kept[j]]);
+			if (before > 1.0)
+				ratios.push_back((float)(cv::norm(m_next[kept[i]] - m_next[kept[j]]) / before));
+		}
+	}
+	float scale = ratios.empty() ? 1.f : median(ratios);
+	float width = m_face.width * scale, height = m_face.height * scale;
+	float cx = m_face.x + m_face.width / 2.f + median(dx);
+	float cy = m_face.y + m_face.height / 2.f + median(dy);
+	face = cv::Rect(cvRound(cx - width / 2), cvRound(cy - height / 2), cvRound(width), cvRound(height));
+	if ((face & cv::Rect(0, 0, gray.cols, gray.rows)).area() < face.area() / 2)
+		return false;
+
+	// New corners on the current frame for the next update; face stays
+	// unclamped so the caller sees how much of it left the frame
+	init(gray, face);
+	return (int)m_points.size() >= MIN_POINTS;
+}
+
+CorrelationTracker::CorrelationTracker(int size, double learningRate, double minPsr) :
+	m_size(cv::getOptimalDFTSize(std::max(size, 16))),
+	m_learningRate(std::min(std::max(learningRate, 0.0), 1.0)),
+	m_minPsr(minPsr)
+{
+	cv::createHanningWindow(m_window, cv::Size(m_size, m_size), CV_32F);
+
+	cv::Mat gaussian(m_size, m_size, CV_32F);
+	double c = m_size / 2;
+	for (int y = 0; y < m_size; y++) {
+		float *row = gaussian.ptr<float>(y);
+		for (int x = 0; x < m_size; x++)
+			row[x] = (float)std::exp(-((x - c) * (x - c) + (y - c) * (y - c)) / (2 * SIGMA * SIGMA));
+	}
+	cv::dft(gaussian, m_target, cv::DFT_COMPLEX_OUTPUT);
+}
+
+double CorrelationTracker::confidence() const
+{
+	return std::min(m_lastPsr / (2 * std::max(m_minPsr, 1.0)), 1.0);
+}
+
+double CorrelationTracker::lastPsr() const
+{
+	return m_lastPsr;
+}
+
+/*
+* Window around center, scaled to m_size, log-mapped, normalized and
+* tapered by the Hanning window, into m_spectrum.
+*/
+void CorrelationTracker::sample(const cv::Mat &gray, const cv::Point2f &center)
+{
+	int side = std::max(cvRound(std::max(m_face.width, m_face.height) * PADDING), 1);
+	cv::getRectSubPix(gray, cv::Size(side, side), center, m_patch);
+	cv::resize(m_patch, m_patch, cv::Size(m_size, m_size), 0, 0, cv::INTER_AREA);
+	m_patch.convertTo(m_patch, CV_32F, 1, 1);
+	cv::log(m_patch, m_patch);
+
+	cv::Scalar mean, stddev;
+	cv::meanStdDev(m_patch, mean, stddev);
+	m_patch = (m_patch - mean[0]) / std::max(stddev[0], 1e-5);
+	cv::multiply(m_patch, m_window, m_patch);
+	cv::dft(m_patch, m_spectrum, cv::DFT_COMPLEX_OUTPUT);
+}
+
+/*
+* Running average of the filter terms; rate 1 starts over.
+*/
+void CorrelationTracker::learn(double rate)
+{
+	cv::mulSpectrums(m_target, m_spectrum, m_product, 0, true);
+	if (rate >= 1.0 || m_numerator.empty())
+		m_product.copyTo(m_numerator);
+	else
+		cv::addWeighted(m_product, rate, m_numerator, 1.0 - rate, 0.0, m_numerator);
+
+	// |F|^2 is real, keep one channel; the offset regularizes the division
+	cv::Mat energy;
+	cv::mulSpectrums(m_spectrum, m_spectrum, m_product, 0, true);
+	cv::extractChannel(m_product, energy, 0);
+	energy += 1e-3;
+	if (rate >= 1.0 || m_denominator.empty())
+		energy.copyTo(m_denominator);
+	else
+		cv::addWeighted(energy, rate, m_denominator, 1.0 - rate, 0.0, m_denominator);
+}
+
+void CorrelationTracker::init(const cv::Mat &gray, const cv::Rect &face)
+{
+	m_face = face;
+	sample(gray, cv::Point2f(face.x + face.width / 2.f, face.y + face.height / 2.f));
+	learn(1.0);
+}
+
+bool CorrelationTracker::update(const cv::Mat &gray, cv::Rect &face)
+{
+	if (m_numerator.empty())
+		return false;
+
+	cv::Point2f center(m_face.x + m_face.width / 2.f, m_face.y + m_face.height / 2.f);
+	sample(gray, center);
+
+	// Response F * conj(H) with conj(H) = numerator / denominator
+	cv::mulSpectrums(m_spectrum, m_numerator, m_product, 0, false);
+	cv::Mat parts[2];
+	cv::split(m_product, parts);
+	cv::divide(parts[0], m_denominator, parts[0]);
+	cv::divide(parts[1], m_denominator, parts[1]);
+	cv::merge(parts, 2, m_product);
+	cv::idft(m_product, m_response, cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+	double peak;
+	cv::Point loc;
+	cv::minMaxLoc(m_response, NULL, &peak, NULL, &loc);
+
+	// Peak to sidelobe ratio, the sidelobe excludes 11x11 around the peak
+	cv::Mat sidelobe(m_response.size(), CV_8U, cv::Scalar(255));
+	sidelobe(cv::Rect(loc.x - 5, loc.y - 5, 11, 11) & cv::Rect(0, 0, m_size, m_size)).setTo(0);
+	cv::Scalar mean, stddev;
+	cv::meanStdDev(m_response, mean, stddev, sidelobe);
+	m_lastPsr = (peak - mean[0]) / std::max(stddev[0], 1e-5);
+	if (m_lastPsr < m_minPsr)
+		return false;
+
+	// Peak offset from the window center, in frame pixels
+	double scale = std::max(m_face.width, m_face.height) * PADDING / m_size;
+	center.x += (float)((loc.x - m_size / 2) * scale);
+	center.y += (float)((loc.y - m_size / 2) * scale);
+	if (!cv::Rect(0, 0, gray.cols, gray.rows).contains(center))
+		return false;
+	m_face.x = cvRound(center.x - m_face.width / 2.f);
+	m_face.y = cvRound(center.y - m_face.height / 2.f);
+
+	sample(gray, center);
+	learn(m_learningRate);
+	face = m_face;
+	return true;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <opencv2\core.hpp>
+#include <vector>
+
+// Frame-to-frame face tracker on the grayscale resized frame, used between
+// cascade detections. init() takes the face from a detection, update()
+// moves it to the next frame and returns false once the target is lost.
+class FaceTracker
+{
+public:
+	virtual ~FaceTracker() {}
+
+	virtual void			init(const cv::Mat &gray, const cv::Rect &face) = 0;
+	virtual bool			update(const cv::Mat &gray, cv::Rect &face) = 0;
+	// Confidence in [0, 1] of the last successful update
+	virtual double			confidence() const = 0;
+};
+
+// Sparse pyramidal Lucas-Kanade on up to maxPoints corners of the face.
+// The face moves by the median point displacement and scales by the
+// median change of the point distances; points with a large
+// forward-backward error are ignored.
+class OpticalFlowTracker : public FaceTracker
+{
+public:
+	OpticalFlowTracker(int maxPoints = 20, int levels = 2);
+
+	void					init(const cv::Mat &gray, const cv::Rect &face);
+	bool					update(const cv::Mat &gray, cv::Rect &face);
+	// Fraction of the points that passed the forward-backward check
+	double					confidence() const;
+
+private:
+	static const int		MIN_POINTS;
+
+	int						m_maxPoints;
+	int						m_levels;
+	double					m_confidence = 0;
+	cv::Rect				m_face;
+	cv::Rect				m_region;		// search area of the next update, frame coordinates
+	cv::Mat					m_prev;			// gray(m_region) of the last frame
+	std::vector<cv::Point2f>	m_points;	// m_region coordinates
+	std::vector<cv::Point2f>	m_next;
+	std::vector<cv::Point2f>	m_back;
+	std::vector<uchar>		m_status;
+	std::vector<uchar>		m_backStatus;
+	std::vector<float>		m_error;
+};
+
+// MOSSE correlation filter (Bolme et al.) learned on a size x size window
+// around the face, evaluated with two DFTs per update. The peak to
+// sidelobe ratio of the response decides whether the target is lost.
+// Translation only: the face keeps its size until the next detection.
+class CorrelationTracker : public FaceTracker
+{
+public:
+	CorrelationTracker(int size = 64, double learningRate = 0.125, double minPsr = 7);
+
+	void					init(const cv::Mat &gray, const cv::Rect &face);
+	bool					update(const cv::Mat &gray, cv::Rect &face);
+	// Peak to sidelobe ratio relative to twice the loss threshold
+	double					confidence() const;
+
+	double					lastPsr() const;
+
+private:
+	static const double		PADDING;
+	static const double		SIGMA;
+
+	int						m_size;
+	double					m_learningRate;
+	double					m_minPsr;
+	double					m_lastPsr = 0;
+	cv::Rect				m_face;
+	cv::Mat					m_window;		// Hanning window
+	cv::Mat					m_target;		// DFT of the desired gaussian response
+	cv::Mat					m_numerator;	// running sum of G * conj(F)
+	cv::Mat					m_denominator;	// running sum of F * conj(F), real
+	cv::Mat					m_patch;
+	cv::Mat					m_spectrum;
+	cv::Mat					m_product;
+	cv::Mat					m_response;
+
+	void		sample(const cv::Mat &gray, const cv::Point2f &center);
+	void		learn(double rate);
+};
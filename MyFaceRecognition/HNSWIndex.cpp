@@ -0,0 +1,321 @@
+#include "HNSWIndex.h"
+#include "HistogramDistance.h"
+#include <opencv2/core/hal/hal.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <queue>
+#include <unordered_set>
+
+HNSWIndex::HNSWIndex(int M, int efConstruction, int metric) :
+	m_M(std::max(M, 2)),
+	m_maxM0(2 * std::max(M, 2)),
+	m_efConstruction(std::max(efConstruction, 1)),
+	m_metric(metric),
+	m_levelMult(1.0 / std::log((double)std::max(M, 2)))
+{
+}
+
+void HNSWIndex::clear()
+{
+	m_entryPoint = -1;
+	m_maxLevel = -1;
+	m_levels.clear();
+	m_links.clear();
+}
+
+float HNSWIndex::distance(const float *query, int id, const RowAccessor &rows, int dims) const
+{
+	const float *row = rows(id);
+	if (m_metric == METRIC_L2)
+		return cv::hal::normL2Sqr_(row, query, dims);
+
+	// same definition as compareHist(row, query, CV_COMP_CHISQR)
+	return ChiSquareDistance::compute(row, query, NULL, dims);
+}
+
+void HNSWIndex::searchLayer(const float *query, const std::vector<Neighbor> &entryPoints, int ef, int level,
+	const RowAccessor &rows, int dims, std::vector<Neighbor> &result, size_t *evaluated) const
+{
+	std::unordered_set<int> visited;
+	// closest candidate on top
+	std::priority_queue<Neighbor, std::vector<Neighbor>, std::greater<Neighbor> > candidates;
+	// furthest result on top
+	std::priority_queue<Neighbor> found;
+
+	for (const Neighbor &ep : entryPoints) {
+		visited.insert(ep.second);
+		candidates.push(ep);
+		found.push(ep);
+		if ((int)found.size() > ef)
+			found.pop();
+	}
+
+	while (!candidates.empty()) {
+		Neighbor current = candidates.top();
+		if ((int)found.size() >= ef && current.first > found.top().first)
+			break;
+		candidates.pop();
+
+		for (int n : m_links[current.second][level]) {
+			if (!visited.insert(n).second)
+				continue;
+			float d = distance(query, n, rows, dims);
+			if (evaluated)
+				(*evaluated)++;
+			if ((int)found.size() < ef || d < found.top().first) {
+				candidates.push(Neighbor(d, n));
+				found.push(Neighbor(d, n));
+				if ((int)found.size() > ef)
+					found.pop();
+			}
+		}
+	}
+
+	result.resize(found.size());
+	for (int i = (int)found.size() - 1; i >= 0; i--) {
+		result[i] = found.top();
+		found.pop();
+	}
+}
+
+/*
+* Neighbor selection heuristic: a candidate is kept only if it is closer to
+* the base element than to every neighbor already selected, which keeps
+* links spread over different directions. Pruned candidates fill up the
+* remaining slots.
+*/
+void HNSWIndex::selectNeighbors(const std::vector<Neighbor> &candidates, int maxCount,
+	const RowAccessor &rows, int dims, std::vector<int> &selected) const
+{
+	std::vector<Neighbor> sorted = candidates;
+	std::sort(sorted.begin(), sorted.end());
+
+	selected.clear();
+	std::vector<int> pruned;
+	for (const Neighbor &c : sorted) {
+		if ((int)selected.size() >= maxCount)
+			break;
+		const float *row = rows(c.second);
+		bool keep = true;
+		for (int s : selected) {
+			if (distance(row, s, rows, dims) < c.first) {
+				keep = false;
+				break;
+			}
+		}
+		if (keep)
+			selected.push_back(c.second);
+		else
+			pruned.push_back(c.second);
+	}
+	for (size_t i = 0; i < pruned.size() && (int)selected.size() < maxCount; i++)
+		selected.push_back(pruned[i]);
+}
+
+void HNSWIndex::shrinkLinks(int id, int level, const RowAccessor &rows, int dims)
+{
+	std::vector<int> &links = m_links[id][level];
+	const float *row = rows(id);
+	std::vector<Neighbor> candidates;
+	candidates.reserve(links.size());
+	for (int n : links)
+		candidates.push_back(Neighbor(distance(row, n, rows, dims), n));
+	selectNeighbors(candidates, level == 0 ? m_maxM0 : m_M, rows, dims, links);
+}
+
+void HNSWIndex::insert(int id, const RowAccessor &rows, int dims)
+{
+	CV_Assert(id == size());
+
+	// exponentially decaying level distribution
+	double u = std::max(m_rng.uniform(0.0, 1.0), DBL_MIN);
+	int level = (int)std::floor(-std::log(u) * m_levelMult);
+	m_levels.push_back(level);
+	m_links.push_back(std::vector<std::vector<int> >(level + 1));
+	link(id, rows, dims);
+}
+
+/*
+* Connects id, with its level set and no links yet, to the graph.
+*/
+void HNSWIndex::link(int id, const RowAccessor &rows, int dims)
+{
+	int level = m_levels[id];
+	if (m_entryPoint < 0) {
+		m_entryPoint = id;
+		m_maxLevel = level;
+		return;
+	}
+
+	const float *query = rows(id);
+	std::vector<Neighbor> entryPoints(1, Neighbor(distance(query, m_entryPoint, rows, dims), m_entryPoint));
+	std::vector<Neighbor> found;
+
+	// greedy descent through the layers above the new element
+	for (int lc = m_maxLevel; lc > level; lc--) {
+		searchLayer(query, entryPoints, 1, lc, rows, dims, found, NULL);
+		entryPoints.assign(1, found[0]);
+	}
+
+	for (int lc = std::min(level, m_maxLevel); lc >= 0; lc--) {
+		searchLayer(query, entryPoints, m_efConstruction, lc, rows, dims, found, NULL);
+		selectNeighbors(found, m_M, rows, dims, m_links[id][lc]);
+		int maxLinks = (lc == 0) ? m_maxM0 : m_M;
+		for (int n : m_links[id][lc]) {
+			m_links[n][lc].push_back(id);
+			if ((int)m_links[n][lc].size() > maxLinks)
+				shrinkLinks(n, lc, rows, dims);
+		}
+		entryPoints = found;
+	}
+
+	if (level > m_maxLevel) {
+		m_maxLevel = level;
+		m_entryPoint = id;
+	}
+}
+
+/*
+* Takes id out of the graph. Every element linking to id loses that link
+* and picks its neighbors again from its remaining links and the links of
+* id, so the graph stays connected around the gap. The incoming links are
+* found by a scan over the ids, which costs no distance computations.
+*/
+void HNSWIndex::unlink(int id, const RowAccessor &rows, int dims)
+{
+	for (int lc = 0; lc <= m_levels[id]; lc++) {
+		const std::vector<int> &orphans = m_links[id][lc];
+		int maxLinks = (lc == 0) ? m_maxM0 : m_M;
+		for (int n = 0; n < size(); n++) {
+			if (n == id || m_levels[n] < lc)
+				continue;
+			std::vector<int> &links = m_links[n][lc];
+			std::vector<int>::iterator it = std::find(links.begin(), links.end(), id);
+			if (it == links.end())
+				continue;
+			links.erase(it);
+			const float *row = rows(n);
+			std::vector<Neighbor> candidates;
+			for (int c : links)
+				candidates.push_back(Neighbor(distance(row, c, rows, dims), c));
+			for (int c : orphans) {
+				if (c != n && std::find(links.begin(), links.end(), c) == links.end())
+					candidates.push_back(Neighbor(distance(row, c, rows, dims), c));
+			}
+			selectNeighbors(candidates, maxLinks, rows, dims, links);
+		}
+	}
+	m_links[id].assign(m_levels[id] + 1, std::vector<int>());
+
+	// the highest remaining element becomes the entry point
+	if (m_entryPoint == id) {
+		m_entryPoint = -1;
+		m_maxLevel = -1;
+		for (int n = 0; n < size(); n++) {
+			if (n != id && m_levels[n] > m_maxLevel) {
+				m_maxLevel = m_levels[n];
+				m_entryPoint = n;
+			}
+		}
+	}
+}
+
+void HNSWIndex::erase(int id, const RowAccessor &rows, int dims)
+{
+	CV_Assert(id >= 0 && id < size());
+	unlink(id, rows, dims);
+
+	int last = size() - 1;
+	if (id != last) {
+		for (size_t n = 0; n < m_links.size(); n++) {
+			for (std::vector<int> &links : m_links[n])
+				std::replace(links.begin(), links.end(), last, id);
+		}
+		m_levels[id] = m_levels[last];
+		m_links[id].swap(m_links[last]);
+		if (m_entryPoint == last)
+			m_entryPoint = id;
+	}
+	m_levels.pop_back();
+	m_links.pop_back();
+}
+
+void HNSWIndex::update(int id, const RowAccessor &rows, int dims)
+{
+	CV_Assert(id >= 0 && id < size());
+	unlink(id, rows, dims);
+	link(id, rows, dims);
+}
+
+void HNSWIndex::search(const float *query, const RowAccessor &rows, int dims, int k, int ef,
+	std::vector<Neighbor> &result, size_t *evaluated) const
+{
+	result.clear();
+	if (m_entryPoint < 0 || k <= 0)
+		return;
+
+	std::vector<Neighbor> entryPoints(1, Neighbor(distance(query, m_entryPoint, rows, dims), m_entryPoint));
+	if (evaluated)
+		(*evaluated)++;
+	std::vector<Neighbor> found;
+	for (int lc = m_maxLevel; lc > 0; lc--) {
+		searchLayer(query, entryPoints, 1, lc, rows, dims, found, evaluated);
+		entryPoints.assign(1, found[0]);
+	}
+	searchLayer(query, entryPoints, std::max(ef, k), 0, rows, dims, result, evaluated);
+	if ((int)result.size() > k)
+		result.resize(k);
+}
+
+void HNSWIndex::write(cv::FileStorage &fs) const
+{
+	fs << "M" << m_M;
+	fs << "ef_construction" << m_efConstruction;
+	fs << "metric" << m_metric;
+	fs << "entry_point" << m_entryPoint;
+	fs << "max_level" << m_maxLevel;
+	fs << "levels" << m_levels;
+	// per element and level: link count followed by the links
+	std::vector<int> links;
+	for (size_t id = 0; id < m_links.size(); id++) {
+		for (size_t level = 0; level < m_links[id].size(); level++) {
+			links.push_back((int)m_links[id][level].size());
+			links.insert(links.end(), m_links[id][level].begin(), m_links[id][level].end());
+		}
+	}
+	fs << "links" << links;
+}
+
+void HNSWIndex::read(const cv::FileNode &fn)
+{
+	clear();
+	fn["M"] >> m_M;
+	fn["ef_construction"] >> m_efConstruction;
+	fn["metric"] >> m_metric;
+	fn["entry_point"] >> m_entryPoint;
+	fn["max_level"] >> m_maxLevel;
+	fn["levels"] >> m_levels;
+	m_M = std::max(m_M, 2);
+	m_maxM0 = 2 * m_M;
+	m_levelMult = 1.0 / std::log((double)m_M);
+
+	std::vector<int> links;
+	fn["links"] >> links;
+	size_t pos = 0;
+	m_links.resize(m_levels.size());
+	for (size_t id = 0; id < m_levels.size(); id++) {
+		m_links[id].resize(m_levels[id] + 1);
+		for (int level = 0; level <= m_levels[id]; level++) {
+			CV_Assert(pos < links.size());
+			int count = links[pos++];
+			CV_Assert(pos + count <= links.size());
+			m_links[id][level].assign(links.begin() + pos, links.begin() + pos + count);
+			pos += count;
+		}
+	}
+	if (m_levels.empty()) {
+		m_entryPoint = -1;
+		m_maxLevel = -1;
+	}
+}
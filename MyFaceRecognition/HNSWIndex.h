@@ -0,0 +1,76 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// Hierarchical navigable small world graph (Malkov & Yashunin) over a set
+// of descriptors. The index only stores the graph: descriptor rows are
+// looked up by id through a RowAccessor, so the gallery is never copied.
+// Ids must be inserted densely, in order 0, 1, 2, ...; erase() keeps them
+// dense by giving the last id to the erased one, like a swap-with-last
+// removal from the gallery.
+class HNSWIndex
+{
+public:
+	enum Metric {
+		METRIC_L2 = 0,		// squared L2, e.g. on Hellinger-mapped histograms
+		METRIC_CHISQR = 1	// chi-square on raw histograms, stored row as first argument
+	};
+
+	typedef std::function<const float*(int)>	RowAccessor;
+	typedef std::pair<float, int>				Neighbor;	// (distance, id)
+
+	HNSWIndex(int M = 16, int efConstruction = 200, int metric = METRIC_L2);
+
+	// Drops the graph, keeps the parameters.
+	void					clear();
+	bool					empty() const { return m_levels.empty(); }
+	int						size() const { return (int)m_levels.size(); }
+	int						M() const { return m_M; }
+	int						efConstruction() const { return m_efConstruction; }
+	int						metric() const { return m_metric; }
+
+	// Links descriptor id (== size()) into the graph.
+	void					insert(int id, const RowAccessor &rows, int dims);
+
+	// Unlinks id and renumbers the last element to id. The neighbors that
+	// linked to id are reconnected through the neighbors of id. rows must
+	// still return the old descriptors of both.
+	void					erase(int id, const RowAccessor &rows, int dims);
+
+	// Relinks id after its descriptor changed, keeping its level.
+	void					update(int id, const RowAccessor &rows, int dims);
+
+	// Returns up to k nearest ids, closest first. ef >= k is the size of
+	// the dynamic candidate list on the bottom layer. If evaluated is
+	// given, it receives the number of distance computations.
+	void					search(const float *query, const RowAccessor &rows, int dims, int k, int ef,
+								std::vector<Neighbor> &result, size_t *evaluated = NULL) const;
+
+	void					write(cv::FileStorage &fs) const;
+	void					read(const cv::FileNode &fn);
+
+private:
+	int						m_M;
+	int						m_maxM0;
+	int						m_efConstruction;
+	int						m_metric;
+	double					m_levelMult;
+	int						m_entryPoint = -1;
+	int						m_maxLevel = -1;
+	cv::RNG					m_rng;
+	std::vector<int>		m_levels;
+	// m_links[id][level] holds the neighbors of id on that level
+	std::vector<std::vector<std::vector<int> > > m_links;
+
+	float		distance(const float *query, int id, const RowAccessor &rows, int dims) const;
+	void		searchLayer(const float *query, const std::vector<Neighbor> &entryPoints, int ef, int level,
+					const RowAccessor &rows, int dims, std::vector<Neighbor> &result, size_t *evaluated) const;
+	void		selectNeighbors(const std::vector<Neighbor> &candidates, int maxCount,
+					const RowAccessor &rows, int dims, std::vector<int> &selected) const;
+	void		shrinkLinks(int id, int level, const RowAccessor &rows, int dims);
+	void		link(int id, const RowAccessor &rows, int dims);
+	void		unlink(int id, const RowAccessor &rows, int dims);
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// Histogram distance policies for the LBPH scan loop. Every policy has a
+// static compute(a, b, w, n) with a the stored (gallery) histogram, b the
+// query and w optional per-bin weights, vectorized with OpenCV's universal
+// intrinsics. HELLINGER policies expect square-rooted histograms.
+// Smaller is closer for all of them.
+
+// sum((a - b)^2 / a) over a > 0, same as compareHist(a, b, CV_COMP_CHISQR)
+struct ChiSquareDistance
+{
+	enum { HELLINGER = 0 };
+
+	static inline float compute(const float *a, const float *b, const float * /*w*/, int n)
+	{
+		int i = 0;
+		float result = 0.f;
+#if CV_SIMD128
+		cv::v_float32x4 eps = cv::v_setall_f32(FLT_EPSILON), zero = cv::v_setzero_f32(), sum = cv::v_setzero_f32();
+		for (; i <= n - 4; i += 4) {
+			cv::v_float32x4 va = cv::v_load(a + i), d = va - cv::v_load(b + i);
+			sum += cv::v_select(va > eps, d * d / va, zero);
+		}
+		result = cv::v_reduce_sum(sum);
+#endif
+		for (; i < n; i++) {
+			if (a[i] > FLT_EPSILON) {
+				float d = a[i] - b[i];
+				result += d * d / a[i];
+			}
+		}
+		return result;
+	}
+};
+
+// sum(w * (a - b)^2 / a) over a > 0
+struct WeightedChiSquareDistance
+{
+	enum { HELLINGER = 0 };
+
+	static inline float compute(const float *a, const float *b, const float *w, int n)
+	{
+		int i = 0;
+		float result = 0.f;
+#if CV_SIMD128
+		cv::v_float32x4 eps = cv::v_setall_f32(FLT_EPSILON), zero = cv::v_setzero_f32(), sum = cv::v_setzero_f32();
+		for (; i <= n - 4; i += 4) {
+			cv::v_float32x4 va = cv::v_load(a + i), d = va - cv::v_load(b + i);
+			sum += cv::v_select(va > eps, cv::v_load(w + i) * d * d / va, zero);
+		}
+		result = cv::v_reduce_sum(sum);
+#endif
+		for (; i < n; i++) {
+			if (a[i] > FLT_EPSILON) {
+				float d = a[i] - b[i];
+				result += w[i] * d * d / a[i];
+			}
+		}
+		return result;
+	}
+};
+
+// Mass of a not covered by b, sum(max(a - b, 0)) = sum(a) - sum(min(a, b)),
+// i.e. one minus the histogram intersection per cell.
+struct IntersectionDistance
+{
+	enum { HELLINGER = 0 };
+
+	static inline float compute(const float *a, const float *b, const float * /*w*/, int n)
+	{
+		int i = 0;
+		float result = 0.f;
+#if CV_SIMD128
+		cv::v_float32x4 zero = cv::v_setzero_f32(), sum = cv::v_setzero_f32();
+		for (; i <= n - 4; i += 4)
+			sum += cv::v_max(cv::v_load(a + i) - cv::v_load(b + i), zero);
+		result = cv::v_reduce_sum(sum);
+#endif
+		for (; i < n; i++)
+			result += std::max(a[i] - b[i], 0.f);
+		return result;
+	}
+};
+
+// sum(|a - b|)
+struct L1Distance
+{
+	enum { HELLINGER = 0 };
+
+	static inline float compute(const float *a, const float *b, const float * /*w*/, int n)
+	{
+		int i = 0;
+		float result = 0.f;
+#if CV_SIMD128
+		cv::v_float32x4 sum = cv::v_setzero_f32();
+		for (; i <= n - 4; i += 4)
+			sum += cv::v_absdiff(cv::v_load(a + i), cv::v_load(b + i));
+		result = cv::v_reduce_sum(sum);
+#endif
+		for (; i < n; i++)
+			result += std::abs(a[i] - b[i]);
+		return result;
+	}
+};
+
+// sum((sqrt(a) - sqrt(b))^2) on square-rooted histograms, the squared
+// Hellinger distance (a monotone function of the Bhattacharyya coefficient)
+struct HellingerDistance
+{
+	enum { HELLINGER = 1 };
+
+	static inline float compute(const float *a, const float *b, const float * /*w*/, int n)
+	{
+		int i = 0;
+		float result = 0.f;
+#if CV_SIMD128
+		cv::v_float32x4 sum = cv::v_setzero_f32();
+		for (; i <= n - 4; i += 4) {
+			cv::v_float32x4 d = cv::v_load(a + i) - cv::v_load(b + i);
+			sum += d * d;
+		}
+		result = cv::v_reduce_sum(sum);
+#endif
+		for (; i < n; i++) {
+			float d = a[i] - b[i];
+			result += d * d;
+		}
+		return result;
+	}
+};
@@ -0,0 +1,260 @@
+#include "IVFPQIndex.h"
+#include <opencv2/core/hal/hal.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <queue>
+
+// Larger galleries are subsampled for k-means
+const int IVFPQIndex::MAX_TRAINING_SAMPLES = 65536;
+
+IVFPQIndex::IVFPQIndex(int nlist, int m) :
+	m_nlist(std::max(nlist, 1)),
+	m_m(std::max(m, 1))
+{
+}
+
+void IVFPQIndex::clear()
+{
+	m_size = 0;
+	m_listIds.assign(m_coarse.rows, std::vector<int>());
+	m_listCodes.assign(m_coarse.rows, std::vector<uchar>());
+	m_listOf.clear();
+}
+
+int IVFPQIndex::nearestCentroid(const float *vec) const
+{
+	int best = 0;
+	float bestDist = FLT_MAX;
+	for (int l = 0; l < m_coarse.rows; l++) {
+		float d = cv::hal::normL2Sqr_(m_coarse.ptr<float>(l), vec, m_coarse.cols);
+		if (d < bestDist) {
+			bestDist = d;
+			best = l;
+		}
+	}
+	return best;
+}
+
+void IVFPQIndex::train(const cv::Mat &data)
+{
+	CV_Assert(data.type() == CV_32FC1 && data.rows > 0);
+	if (data.cols % m_m != 0) {
+		cv::String error_message = cv::format("The descriptor size (%d) must be a multiple of the code size (%d).", data.cols, m_m);
+		CV_Error(cv::Error::StsBadArg, error_message);
+	}
+
+	// subsample the training set
+	cv::Mat samples = data;
+	if (data.rows > MAX_TRAINING_SAMPLES) {
+		std::vector<int> order(data.rows);
+		for (int i = 0; i < data.rows; i++)
+			order[i] = i;
+		cv::RNG rng;
+		cv::randShuffle(order, 1.0, &rng);
+		samples.create(MAX_TRAINING_SAMPLES, data.cols, CV_32FC1);
+		for (int i = 0; i < MAX_TRAINING_SAMPLES; i++)
+			data.row(order[i]).copyTo(samples.row(i));
+	}
+
+	cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 20, 1e-4);
+
+	// coarse quantizer
+	cv::Mat assignment;
+	int nlist = std::min(m_nlist, samples.rows);
+	cv::kmeans(samples, nlist, assignment, criteria, 1, cv::KMEANS_PP_CENTERS, m_coarse);
+
+	// residuals to the assigned coarse centroids
+	cv::Mat residuals(samples.size(), CV_32FC1);
+	for (int i = 0; i < samples.rows; i++)
+		cv::subtract(samples.row(i), m_coarse.row(assignment.at<int>(i)), residuals.row(i));
+
+	// one 8-bit codebook per sub-vector
+	m_dsub = samples.cols / m_m;
+	m_ksub = std::min(256, samples.rows);
+	m_codebooks.create(m_m * m_ksub, m_dsub, CV_32FC1);
+	for (int j = 0; j < m_m; j++) {
+		cv::Mat sub = residuals.colRange(j * m_dsub, (j + 1) * m_dsub).clone();
+		cv::Mat subAssignment, centers;
+		cv::kmeans(sub, m_ksub, subAssignment, criteria, 1, cv::KMEANS_PP_CENTERS, centers);
+		centers.copyTo(m_codebooks.rowRange(j * m_ksub, (j + 1) * m_ksub));
+	}
+
+	clear();
+}
+
+void IVFPQIndex::add(int id, const float *vec)
+{
+	CV_Assert(isTrained() && id == m_size);
+	m_listOf.push_back(0);
+	encode(id, vec);
+	m_size++;
+}
+
+/*
+* Appends the code of vec under id to its nearest list.
+*/
+void IVFPQIndex::encode(int id, const float *vec)
+{
+	int list = nearestCentroid(vec);
+	const float *centroid = m_coarse.ptr<float>(list);
+	std::vector<float> residual(m_coarse.cols);
+	for (int d = 0; d < m_coarse.cols; d++)
+		residual[d] = vec[d] - centroid[d];
+
+	for (int j = 0; j < m_m; j++) {
+		int best = 0;
+		float bestDist = FLT_MAX;
+		for (int c = 0; c < m_ksub; c++) {
+			float d = cv::hal::normL2Sqr_(m_codebooks.ptr<float>(j * m_ksub + c), &residual[j * m_dsub], m_dsub);
+			if (d < bestDist) {
+				bestDist = d;
+				best = c;
+			}
+		}
+		m_listCodes[list].push_back((uchar)best);
+	}
+	m_listIds[list].push_back(id);
+	m_listOf[id] = list;
+}
+
+/*
+* Removes the entry of id from its list.
+*/
+void IVFPQIndex::unlist(int id)
+{
+	std::vector<int> &ids = m_listIds[m_listOf[id]];
+	std::vector<uchar> &codes = m_listCodes[m_listOf[id]];
+	size_t pos = std::find(ids.begin(), ids.end(), id) - ids.begin();
+	ids.erase(ids.begin() + pos);
+	codes.erase(codes.begin() + pos * m_m, codes.begin() + (pos + 1) * m_m);
+}
+
+void IVFPQIndex::erase(int id)
+{
+	CV_Assert(id >= 0 && id < m_size);
+	unlist(id);
+
+	int last = m_size - 1;
+	if (id != last) {
+		std::vector<int> &ids = m_listIds[m_listOf[last]];
+		*std::find(ids.begin(), ids.end(), last) = id;
+		m_listOf[id] = m_listOf[last];
+	}
+	m_listOf.pop_back();
+	m_size--;
+}
+
+void IVFPQIndex::update(int id, const float *vec)
+{
+	CV_Assert(id >= 0 && id < m_size);
+	unlist(id);
+	encode(id, vec);
+}
+
+void IVFPQIndex::search(const float *query, int k, int nprobe,
+	std::vector<Neighbor> &result, size_t *scanned) const
+{
+	result.clear();
+	if (!isTrained() || m_size == 0 || k <= 0)
+		return;
+
+	int dims = m_coarse.cols;
+	// closest inverted lists first
+	std::vector<Neighbor> lists(m_coarse.rows);
+	for (int l = 0; l < m_coarse.rows; l++)
+		lists[l] = Neighbor(cv::hal::normL2Sqr_(m_coarse.ptr<float>(l), query, dims), l);
+	nprobe = std::max(1, std::min(nprobe, m_coarse.rows));
+	std::partial_sort(lists.begin(), lists.begin() + nprobe, lists.end());
+
+	// furthest of the current k best on top
+	std::priority_queue<Neighbor> best;
+	std::vector<float> residual(dims);
+	std::vector<float> table(m_m * m_ksub);
+	for (int p = 0; p < nprobe; p++) {
+		int list = lists[p].second;
+		const std::vector<int> &ids = m_listIds[list];
+		if (ids.empty())
+			continue;
+
+		// asymmetric distance table: query residual sub-vector to every codeword
+		const float *centroid = m_coarse.ptr<float>(list);
+		for (int d = 0; d < dims; d++)
+			residual[d] = query[d] - centroid[d];
+		for (int j = 0; j < m_m; j++) {
+			for (int c = 0; c < m_ksub; c++)
+				table[j * m_ksub + c] = cv::hal::normL2Sqr_(m_codebooks.ptr<float>(j * m_ksub + c), &residual[j * m_dsub], m_dsub);
+		}
+
+		const uchar *codes = &m_listCodes[list][0];
+		for (size_t e = 0; e < ids.size(); e++, codes += m_m) {
+			float d = 0.f;
+			for (int j = 0; j < m_m; j++)
+				d += table[j * m_ksub + codes[j]];
+			if ((int)best.size() < k) {
+				best.push(Neighbor(d, ids[e]));
+			}
+			else if (d < best.top().first) {
+				best.pop();
+				best.push(Neighbor(d, ids[e]));
+			}
+		}
+		if (scanned)
+			*scanned += ids.size();
+	}
+
+	result.resize(best.size());
+	for (int i = (int)best.size() - 1; i >= 0; i--) {
+		result[i] = best.top();
+		best.pop();
+	}
+}
+
+void IVFPQIndex::write(cv::FileStorage &fs) const
+{
+	fs << "nlist" << m_nlist;
+	fs << "m" << m_m;
+	fs << "ksub" << m_ksub;
+	fs << "coarse" << m_coarse;
+	fs << "codebooks" << m_codebooks;
+	// inverted lists, concatenated
+	std::vector<int> listSizes, ids;
+	cv::Mat codes(0, m_m, CV_8UC1);
+	for (size_t l = 0; l < m_listIds.size(); l++) {
+		listSizes.push_back((int)m_listIds[l].size());
+		ids.insert(ids.end(), m_listIds[l].begin(), m_listIds[l].end());
+		if (!m_listIds[l].empty())
+			codes.push_back(cv::Mat((int)m_listIds[l].size(), m_m, CV_8UC1, (void*)&m_listCodes[l][0]));
+	}
+	fs << "list_sizes" << listSizes;
+	fs << "ids" << ids;
+	fs << "codes" << codes;
+}
+
+void IVFPQIndex::read(const cv::FileNode &fn)
+{
+	fn["nlist"] >> m_nlist;
+	fn["m"] >> m_m;
+	fn["ksub"] >> m_ksub;
+	fn["coarse"] >> m_coarse;
+	fn["codebooks"] >> m_codebooks;
+	m_dsub = m_coarse.empty() ? 0 : m_coarse.cols / m_m;
+	clear();
+
+	std::vector<int> listSizes, ids;
+	cv::Mat codes;
+	fn["list_sizes"] >> listSizes;
+	fn["ids"] >> ids;
+	fn["codes"] >> codes;
+	CV_Assert((int)listSizes.size() <= m_coarse.rows);
+	int pos = 0;
+	m_listOf.assign(ids.size(), 0);
+	for (size_t l = 0; l < listSizes.size(); l++) {
+		for (int e = 0; e < listSizes[l]; e++, pos++) {
+			m_listIds[l].push_back(ids[pos]);
+			m_listOf[ids[pos]] = (int)l;
+			const uchar *code = codes.ptr<uchar>(pos);
+			m_listCodes[l].insert(m_listCodes[l].end(), code, code + m_m);
+		}
+	}
+	m_size = pos;
+}
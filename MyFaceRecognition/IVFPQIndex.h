@@ -0,0 +1,64 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <utility>
+#include <vector>
+
+// Inverted file with product-quantized residuals (Jegou et al.). A k-means
+// coarse quantizer splits the descriptors into nlist inverted lists; the
+// residual of every descriptor to its list centroid is split into m
+// sub-vectors, each encoded as one byte of a 256-entry codebook. Queries
+// visit the nprobe closest lists and score codes with per-query asymmetric
+// distance tables. Ids must be added densely, in order 0, 1, 2, ...;
+// erase() keeps them dense by giving the last id to the erased one.
+class IVFPQIndex
+{
+public:
+	typedef std::pair<float, int>	Neighbor;	// (approximate squared L2, id)
+
+	IVFPQIndex(int nlist = 256, int m = 16);
+
+	// Learns the coarse quantizer and the sub-quantizer codebooks from the
+	// rows of data (CV_32FC1). Drops all codes added before.
+	void					train(const cv::Mat &data);
+	bool					isTrained() const { return !m_coarse.empty(); }
+
+	// Drops the codes, keeps the trained quantizers.
+	void					clear();
+	int						size() const { return m_size; }
+	int						nlist() const { return m_nlist; }
+	int						codeSize() const { return m_m; }
+
+	// Encodes descriptor id (== size()) into its inverted list.
+	void					add(int id, const float *vec);
+	// Drops the code of id and renumbers the last id to id.
+	void					erase(int id);
+	// Re-encodes id after its descriptor changed.
+	void					update(int id, const float *vec);
+
+	// Returns up to k ids with the smallest asymmetric distance, closest
+	// first. If scanned is given, it receives the number of codes scored.
+	void					search(const float *query, int k, int nprobe,
+								std::vector<Neighbor> &result, size_t *scanned = NULL) const;
+
+	void					write(cv::FileStorage &fs) const;
+	void					read(const cv::FileNode &fn);
+
+private:
+	static const int		MAX_TRAINING_SAMPLES;
+
+	int						m_nlist;
+	int						m_m;
+	int						m_ksub = 0;
+	int						m_dsub = 0;
+	int						m_size = 0;
+	cv::Mat					m_coarse;		// nlist x dims
+	cv::Mat					m_codebooks;	// (m * ksub) x dsub, codebook of sub-vector j starts at row j * ksub
+	std::vector<std::vector<int> >		m_listIds;
+	std::vector<std::vector<uchar> >	m_listCodes;	// m bytes per entry
+	std::vector<int>		m_listOf;		// inverted list of every id
+
+	int			nearestCentroid(const float *vec) const;
+	void		encode(int id, const float *vec);
+	void		unlist(int id);
+};
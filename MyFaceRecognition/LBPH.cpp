@@ -1,9 +1,36 @@
 #include "LBPH.h"
 #include <iostream>
+#include <opencv2/core/hal/hal.hpp>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 using namespace std;
 
 void elbp(InputArray src, OutputArray dst, int radius, int neighbors);
-static Mat spatial_histogram(InputArray _src, int numPatterns, int grid_x, int grid_y, bool /*normed*/);
+static Mat spatial_histogram(InputArray _src, int numPatterns, int grid_x, int grid_y, bool /*normed*/, const vector<int> *cells = NULL);
+
+template<typename _Tp>
+inline void readFileNodeList(const FileNode& fn, vector<_Tp>& result) {
+	if (fn.type() == FileNode::SEQ) {
+		for (FileNodeIterator it = fn.begin(); it != fn.end();) {
+			_Tp item;
+			it >> item;
+			result.push_back(item);
+		}
+	}
+}
+
+template<typename _Tp>
+inline void writeFileNodeList(FileStorage& fs, const String& name, const vector<_Tp>& items) {
+	// typedefs
+	typedef typename vector<_Tp>::const_iterator constVecIterator;
+	// write the elements in item to fs
+	fs << name << "[";
+	for (constVecIterator it = items.begin(); it != items.end(); ++it) {
+		fs << *it;
+	}
+	fs << "]";
+}
 
 void LBPH::train(InputArrayOfArrays _in_src, InputArray _in_labels) {
 	this->train(_in_src, _in_labels, false);
@@ -44,27 +71,26 @@ void LBPH::train(InputArrayOfArrays _in_src, InputArray _in_labels, bool preserv
 	if (!preserveData) {
 		_labels.release();
 		_histograms.clear();
+		clearDerived();
 	}
 	// append labels to _labels matrix
 	for (size_t labelIdx = 0; labelIdx < labels.total(); labelIdx++) {
 		_labels.push_back(labels.at<int>((int)labelIdx));
 	}
 	// store the spatial histograms of the original data
+	size_t firstNew = _histograms.size();
 	for (size_t sampleIdx = 0; sampleIdx < src.size(); ++sampleIdx) {
-		// calculate lbp image
-		Mat lbp_image;
-		elbp(src[sampleIdx], lbp_image, _radius, _neighbors);
-		// get spatial histogram from this lbp image
-		Mat p = spatial_histogram(
-			lbp_image, /* lbp_image */
-			static_cast<int>(std::pow(2.0, static_cast<double>(_neighbors))), /* number of possible patterns */
-			_grid_x, /* grid size x */
-			_grid_y, /* grid size y */
-			true);
 		// add to templates
-		//Mat tem_p = p.clone();
-		_histograms.push_back(p);
+		_histograms.push_back(extract(src[sampleIdx]));
 	}
+	if (!preserveData)
+		_galleryStats = GalleryStats();
+	_galleryStats.enrolled += src.size();
+	// project / index the new templates, then shrink the labels over
+	// capacity in place; a reduction drops the VP-tree, rebuilt here
+	indexSamples(firstNew);
+	if (reduceGallery(firstNew))
+		indexSamples(_histograms.size());
 }
 
 static Mat histc_(const Mat& src, int minVal = 0, int maxVal = 255, bool normed = false)
@@ -114,7 +140,7 @@ static Mat histc(InputArray _src, int minVal, int maxVal, bool normed)
 	return Mat();
 }
 
-static Mat spatial_histogram(InputArray _src, int numPatterns, int grid_x, int grid_y, bool /*normed*/)
+static Mat spatial_histogram(InputArray _src, int numPatterns, int grid_x, int grid_y, bool /*normed*/, const vector<int> *cells)
 {
 	// LBPMĿռֱͼֲõһһά
 	// srcΪLBPMͨolbpelbpõ
@@ -123,7 +149,8 @@ static Mat spatial_histogram(InputArray _src, int numPatterns, int grid_x, int g
 	// normedΪǷйһ
 	Mat src = _src.getMat();
 	// allocate memory for the spatial histogramΪLBPHڴռ
-	Mat result = Mat::zeros(grid_x * grid_y, numPatterns, CV_32FC1);
+	// cells, if given, is the sorted list of cell indices to keep
+	Mat result = Mat::zeros(cells ? (int)cells->size() : grid_x * grid_y, numPatterns, CV_32FC1);
 	// return matrix with zeros if no data was givenûݣص0
 	if (src.empty())
 		return result.reshape(1, 1);
@@ -137,6 +164,8 @@ static Mat spatial_histogram(InputArray _src, int numPatterns, int grid_x, int g
 	{
 		for (int j = 0; j < grid_x; j++)
 		{
+			if (cells && !std::binary_search(cells->begin(), cells->end(), i * grid_x + j))
+				continue;
 			// ȡָ
 			Mat src_cell = Mat(src, Range(i*height, (i + 1)*height), Range(j*width, (j + 1)*width));
 			// ֱָͼ
@@ -223,38 +252,1509 @@ static void elbp(InputArray src, OutputArray dst, int radius, int neighbors)
 
 
 void LBPH:: predict(InputArray _src, int &minClass, double &minDist) const {
-	int _grid_x = 8;
-	int _grid_y = 8;
-	int _radius = 1;
-	int _neighbors = 8;
-	double _threshold = 2100.0;
+	predict(_src, minClass, minDist, NULL);
+}
+
+void LBPH::predict(InputArray _src, int &minClass, double &minDist, SearchStats *stats) const {
+	// get the spatial histogram from input image
+	predictDescriptor(extract(_src), minClass, minDist, stats);
+}
+
+Mat LBPH::descriptor(InputArray src) const {
+	return extract(src);
+}
+
+void LBPH::predictDescriptor(const Mat &query, int &minClass, double &minDist, SearchStats *stats) const {
 	if (_histograms.empty()) {
 		// throw error if no data (or simply return -1?)
 		string error_message = "This LBPH model is not computed yet. Did you call the train method?";
 		CV_Error(CV_StsBadArg, error_message);
 
 	}
-	Mat src = _src.getMat();
-	// get the spatial histogram from input image
+	SearchStats localStats;
+	if (stats == NULL)
+		stats = &localStats;
+	*stats = SearchStats();
+	// match in the projected space if the model has one
+	if (!_projected.empty()) {
+		predictProjected(query, minClass, minDist);
+		stats->compared = _projected.rows;
+		return;
+	}
+	// re-rank the candidates of an index only
+	double threshold = metricThreshold(_metric);
+	vector<int> candidates;
+	if (searchCandidates(query, candidates, *stats)) {
+		int sampleIdx = rerank(query, candidates, threshold, minDist);
+		minClass = (sampleIdx < 0) ? -1 : _labels.at<int>(sampleIdx);
+		stats->compared = candidates.size();
+		return;
+	}
+	// find 1-nearest neighbor
+	stats->compared = _histograms.size();
+	int sampleIdx = nearest(query, NULL, _histograms.size(), threshold, minDist);
+	minClass = (sampleIdx < 0) ? -1 : _labels.at<int>(sampleIdx);
+}
+
+Mat LBPH::extract(InputArray _src) const {
+	// calculate lbp image
 	Mat lbp_image;
-	elbp(src, lbp_image, _radius, _neighbors);
-	Mat query = spatial_histogram(
+	elbp(_src, lbp_image, _radius, _neighbors);
+	// get spatial histogram from this lbp image
+	return spatial_histogram(
 		lbp_image, /* lbp_image */
 		static_cast<int>(std::pow(2.0, static_cast<double>(_neighbors))), /* number of possible patterns */
 		_grid_x, /* grid size x */
 		_grid_y, /* grid size y */
-		true /* normed histograms */);
-	// find 1-nearest neighbor
+		true, /* normed histograms */
+		_activeCells.empty() ? NULL : &_activeCells /* cells kept by the weight map */);
+}
+
+void LBPH::setProjection(int projection, int dims, int metric) {
+	if (projection < PROJECTION_NONE || projection > PROJECTION_WHITENED_PCA) {
+		string error_message = format("Unknown projection %d.", projection);
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	if (dims <= 0) {
+		string error_message = format("The projection needs at least one dimension (given %d).", dims);
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	_projection = projection;
+	_projectionDims = dims;
+	_projectedMetric = metric;
+	// drop the old basis; a trained model is projected again right away so
+	// queries and gallery stay in one space
+	_pca = PCA();
+	_projected.release();
+	indexSamples(_histograms.size());
+}
+
+void LBPH::fitProjection() {
+	// stack the (square-rooted) histograms as rows
+	Mat data((int)_histograms.size(), _histograms[0].cols, CV_32FC1);
+	for (int sampleIdx = 0; sampleIdx < data.rows; sampleIdx++) {
+		Mat row = data.row(sampleIdx);
+		if (_projection == PROJECTION_WHITENED_PCA)
+			cv::sqrt(_histograms[sampleIdx], row);
+		else
+			_histograms[sampleIdx].copyTo(row);
+	}
+	// keeps at most min(samples, dims) components
+	_pca = PCA(data, Mat(), PCA::DATA_AS_ROW, _projectionDims);
+	// project the whole gallery
+	_projected.release();
+	for (size_t sampleIdx = 0; sampleIdx < _histograms.size(); sampleIdx++) {
+		_projected.push_back(project(_histograms[sampleIdx]));
+	}
+}
+
+Mat LBPH::project(const Mat &hist) const {
+	Mat coeffs;
+	if (_projection == PROJECTION_WHITENED_PCA) {
+		// Hellinger mapping, then scale every component to unit variance
+		Mat root;
+		cv::sqrt(hist, root);
+		coeffs = _pca.project(root);
+		// regularized so near-empty trailing components are not blown up
+		float eps = 1e-3f * _pca.eigenvalues.at<float>(0) + FLT_EPSILON;
+		for (int i = 0; i < coeffs.cols; i++) {
+			coeffs.at<float>(i) /= std::sqrt(_pca.eigenvalues.at<float>(i) + eps);
+		}
+	}
+	else {
+		coeffs = _pca.project(hist);
+	}
+	// cosine distance is a dot product of unit vectors
+	if (_projectedMetric == PROJECTED_COSINE)
+		normalize(coeffs, coeffs);
+	return coeffs;
+}
+
+void LBPH::clearDerived() {
+	_pca = PCA();
+	_projected.release();
+	_hellinger.release();
+	_hellingerNorms.release();
+	_hnsw.clear();
+	_ivfpq.clear();
+	_vptree.clear();
+	_labelSamples.clear();
+	_labelSums.clear();
+	_labelPrototypes.clear();
+	_coarse.release();
+	_signatureMean.release();
+	_signatureProjection.release();
+	_signatures.release();
+	_postings.clear();
+	_postedSamples = 0;
+}
+
+void LBPH::indexSamples(size_t first) {
+	if (_histograms.empty())
+		return;
+	// per-label sample lists and running sums, then the prototypes of
+	// every label that got new samples
+	vector<int> touched;
+	for (size_t sampleIdx = first; sampleIdx < _histograms.size(); sampleIdx++) {
+		int label = _labels.at<int>((int)sampleIdx);
+		vector<int> &samples = _labelSamples[label];
+		if (samples.empty()) {
+			_labelSums[label] = Mat::zeros(_histograms[sampleIdx].size(), CV_32FC1);
+		}
+		samples.push_back((int)sampleIdx);
+		_labelSums[label] += _histograms[sampleIdx];
+		if (std::find(touched.begin(), touched.end(), label) == touched.end())
+			touched.push_back(label);
+	}
+	for (size_t i = 0; i < touched.size(); i++)
+		updatePrototypes(touched[i]);
+	// pooled coarse-grid histograms for SEARCH_PYRAMID, on the full grid only
+	if (_searchMode == SEARCH_PYRAMID && _activeCells.empty() && _grid_x % _coarseGrid == 0 && _grid_y % _coarseGrid == 0) {
+		for (int sampleIdx = _coarse.rows; sampleIdx < (int)_histograms.size(); sampleIdx++) {
+			_coarse.push_back(pool(_histograms[sampleIdx], _coarseGrid));
+		}
+	}
+	else {
+		_coarse.release();
+	}
+	// square-rooted histograms turn chi-square-like matching into L2; a
+	// second copy of the gallery, kept only for the metric and indexes
+	// that read it
+	if (hellingerNeeded()) {
+		for (int sampleIdx = _hellinger.rows; sampleIdx < (int)_histograms.size(); sampleIdx++) {
+			Mat root;
+			cv::sqrt(_histograms[sampleIdx], root);
+			_hellinger.push_back(root);
+			_hellingerNorms.push_back(static_cast<float>(root.dot(root)));
+		}
+	}
+	else {
+		_hellinger.release();
+		_hellingerNorms.release();
+	}
+	// incremental inserts, so enrollment doesn't rebuild the graph
+	if (_hnswEnabled) {
+		HNSWIndex::RowAccessor rows = hnswRows();
+		for (int id = _hnsw.size(); id < (int)_histograms.size(); id++) {
+			_hnsw.insert(id, rows, _histograms[0].cols);
+		}
+	}
+	if (_ivfpqEnabled)
+		addIVFPQ();
+	// the tree has no cheap inserts, rebuild it over the grown gallery
+	if (_vptreeEnabled && _vptree.size() != _hellinger.rows)
+		_vptree.build(_hellinger.rows, hellingerRows(), _hellinger.cols);
+	// posting lists of the significant (cell, bin) entries for SEARCH_INVERTED
+	if (_searchMode == SEARCH_INVERTED)
+		addPostings();
+	else {
+		_postings.clear();
+		_postedSamples = 0;
+	}
+	// binary signatures while SEARCH_BINARY is selected, centered on the
+	// gallery they were first fitted to
+	if (_searchMode == SEARCH_BINARY) {
+		if (_signatureProjection.empty())
+			fitSignatures();
+		for (int sampleIdx = _signatures.rows; sampleIdx < (int)_histograms.size(); sampleIdx++)
+			_signatures.push_back(signature(_histograms[sampleIdx]));
+	}
+	else {
+		_signatureProjection.release();
+		_signatures.release();
+	}
+	// the projection is learned once, later samples are only mapped
+	if (_projection != PROJECTION_NONE) {
+		if (_pca.eigenvectors.empty()) {
+			fitProjection();
+		}
+		else {
+			for (size_t sampleIdx = first; sampleIdx < _histograms.size(); sampleIdx++) {
+				_projected.push_back(project(_histograms[sampleIdx]));
+			}
+		}
+	}
+}
+
+void LBPH::predictProjected(const Mat &query, int &minClass, double &minDist) const {
+	Mat q = project(query);
+	const float *qp = q.ptr<float>();
+	int dims = _projected.cols;
 	minDist = DBL_MAX;
 	minClass = -1;
-	for (size_t sampleIdx = 0; sampleIdx < _histograms.size(); sampleIdx++) {
-		double dist = compareHist(_histograms[sampleIdx], query, CV_COMP_CHISQR);
+	for (int sampleIdx = 0; sampleIdx < _projected.rows; sampleIdx++) {
+		const float *gp = _projected.ptr<float>(sampleIdx);
+		double dist;
+		if (_projectedMetric == PROJECTED_COSINE) {
+			float dot = 0.f;
+			for (int i = 0; i < dims; i++)
+				dot += gp[i] * qp[i];
+			dist = 1.0 - dot;
+		}
+		else {
+			dist = std::sqrt(hal::normL2Sqr_(gp, qp, dims));
+		}
 		if ((dist < minDist) && (dist < _threshold)) {
 			minDist = dist;
-			minClass = _labels.at<int>((int)sampleIdx);
+			minClass = _labels.at<int>(sampleIdx);
+		}
+	}
+}
 
+void LBPH::predictBatch(InputArrayOfArrays _src, OutputArray _dst_labels, OutputArray _dst_dists) const {
+	// number of gallery rows handled by one gemm call
+	const int blockSize = 4096;
+	if (_histograms.empty()) {
+		string error_message = "This LBPH model is not computed yet. Did you call the train method?";
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	if (_src.kind() != _InputArray::STD_VECTOR_MAT && _src.kind() != _InputArray::STD_VECTOR_VECTOR) {
+		string error_message = "The images are expected as InputArray::STD_VECTOR_MAT (a std::vector<Mat>) or _InputArray::STD_VECTOR_VECTOR (a std::vector< vector<...> >).";
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	vector<Mat> src;
+	_src.getMatVector(src);
+	int numQueries = (int)src.size();
+	_dst_labels.create(numQueries, 1, CV_32SC1);
+	_dst_dists.create(numQueries, 1, CV_64FC1);
+	Mat labels = _dst_labels.getMat();
+	Mat dists = _dst_dists.getMat();
+	if (numQueries == 0)
+		return;
+	// Hellinger-mapped query block
+	int numSamples = (int)_histograms.size();
+	Mat queries(numQueries, _histograms[0].cols, CV_32FC1);
+	vector<float> queryNorms(numQueries);
+	for (int queryIdx = 0; queryIdx < numQueries; queryIdx++) {
+		Mat row = queries.row(queryIdx);
+		cv::sqrt(extract(src[queryIdx]), row);
+		queryNorms[queryIdx] = static_cast<float>(row.dot(row));
+	}
+	labels.setTo(-1);
+	dists.setTo(DBL_MAX);
+	// the reported distance is the square root of METRIC_HELLINGER's
+	double threshold = (_threshold != DBL_MAX) ? _threshold : std::sqrt(metricThreshold(METRIC_HELLINGER));
+	// |q - g|^2 = |q|^2 + |g|^2 - 2 q.g, on the stored Hellinger gallery
+	// if a metric or index keeps one, else on blocks mapped on the fly
+	Mat cross, block, blockNorms;
+	for (int first = 0; first < numSamples; first += blockSize) {
+		int last = std::min(first + blockSize, numSamples);
+		if (_hellinger.empty()) {
+			block.create(last - first, queries.cols, CV_32FC1);
+			blockNorms.create(last - first, 1, CV_32FC1);
+			for (int j = 0; j < block.rows; j++) {
+				Mat row = block.row(j);
+				cv::sqrt(_histograms[first + j], row);
+				blockNorms.at<float>(j) = static_cast<float>(row.dot(row));
+			}
+		}
+		else {
+			block = _hellinger.rowRange(first, last);
+			blockNorms = _hellingerNorms.rowRange(first, last);
 		}
+		gemm(queries, block, -2.0, Mat(), 0.0, cross, GEMM_2_T);
+		const float *norms = blockNorms.ptr<float>();
+		for (int queryIdx = 0; queryIdx < numQueries; queryIdx++) {
+			const float *row = cross.ptr<float>(queryIdx);
+			int best = -1;
+			float bestDist = FLT_MAX;
+			for (int j = 0; j < cross.cols; j++) {
+				float d = row[j] + norms[j];
+				if (d < bestDist) {
+					bestDist = d;
+					best = j;
+				}
+			}
+			double dist = std::sqrt(std::max(0.0, (double)bestDist + queryNorms[queryIdx]));
+			if ((dist < dists.at<double>(queryIdx)) && (dist < threshold)) {
+				dists.at<double>(queryIdx) = dist;
+				labels.at<int>(queryIdx) = _labels.at<int>(first + best);
+			}
+		}
+	}
+}
+
+void LBPH::setSearchMode(int mode) {
+	if (mode < SEARCH_LINEAR || mode > SEARCH_INVERTED) {
+		string error_message = format("Unknown search mode %d.", mode);
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	_searchMode = mode;
+	// build what the mode needs, release what only the old one needed
+	indexSamples(_histograms.size());
+}
+
+bool LBPH::hellingerNeeded() const {
+	return _metric == METRIC_HELLINGER || _vptreeEnabled ||
+		(_hnswEnabled && _hnsw.metric() == HNSWIndex::METRIC_L2);
+}
+
+HNSWIndex::RowAccessor LBPH::hnswRows() const {
+	if (_hnsw.metric() == HNSWIndex::METRIC_CHISQR)
+		return [this](int id) { return _histograms[id].ptr<float>(); };
+	return hellingerRows();
+}
+
+HNSWIndex::RowAccessor LBPH::hellingerRows() const {
+	return [this](int id) { return _hellinger.ptr<float>(id); };
+}
+
+void LBPH::buildHNSW(int M, int efConstruction, int metric) {
+	if (metric != HNSWIndex::METRIC_L2 && metric != HNSWIndex::METRIC_CHISQR) {
+		string error_message = format("Unknown HNSW metric %d.", metric);
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	_hnsw = HNSWIndex(M, efConstruction, metric);
+	_hnswEnabled = true;
+	indexSamples(_histograms.size());
+}
+
+void LBPH::setHNSWSearch(int efSearch, int candidates) {
+	_efSearch = std::max(efSearch, 1);
+	_hnswCandidates = std::max(candidates, 1);
+}
+
+void LBPH::searchHNSW(const Mat &query, int ef, int k, vector<int> &ids, size_t *evaluated) const {
+	Mat q;
+	if (_hnsw.metric() == HNSWIndex::METRIC_L2)
+		cv::sqrt(query, q);
+	else
+		q = query;
+	vector<HNSWIndex::Neighbor> found;
+	_hnsw.search(q.ptr<float>(), hnswRows(), q.cols, k, ef, found, evaluated);
+	ids.clear();
+	for (size_t i = 0; i < found.size(); i++)
+		ids.push_back(found[i].second);
+}
 
+int LBPH::rerank(const Mat &query, const vector<int> &candidates, double threshold, double &minDist) const {
+	if (candidates.empty()) {
+		minDist = DBL_MAX;
+		return -1;
 	}
+	return nearest(query, &candidates[0], candidates.size(), threshold, minDist);
 }
 
+template <class Metric>
+int LBPH::scan(const Mat &query, const int *ids, size_t count, double threshold, double &minDist) const {
+	Mat q;
+	if (Metric::HELLINGER)
+		cv::sqrt(query, q);
+	else
+		q = query;
+	const float *qp = q.ptr<float>();
+	const float *weights = _binWeights.empty() ? NULL : _binWeights.ptr<float>();
+	int dims = q.cols;
+	int best = -1;
+	minDist = DBL_MAX;
+	for (size_t i = 0; i < count; i++) {
+		int sampleIdx = ids ? ids[i] : (int)i;
+		const float *row = Metric::HELLINGER ? _hellinger.ptr<float>(sampleIdx) : _histograms[sampleIdx].ptr<float>();
+		double dist = Metric::compute(row, qp, weights, dims);
+		if ((dist < minDist) && (dist < threshold)) {
+			minDist = dist;
+			best = sampleIdx;
+		}
+	}
+	return best;
+}
+
+int LBPH::nearest(const Mat &query, const int *ids, size_t count, double threshold, double &minDist) const {
+	switch (_metric) {
+	case METRIC_INTERSECTION:
+		return scan<IntersectionDistance>(query, ids, count, threshold, minDist);
+	case METRIC_L1:
+		return scan<L1Distance>(query, ids, count, threshold, minDist);
+	case METRIC_HELLINGER:
+		return scan<HellingerDistance>(query, ids, count, threshold, minDist);
+	case METRIC_WEIGHTED_CHISQR:
+		// without weights this is plain chi-square
+		if (!_binWeights.empty())
+			return scan<WeightedChiSquareDistance>(query, ids, count, threshold, minDist);
+		return scan<ChiSquareDistance>(query, ids, count, threshold, minDist);
+	default:
+		return scan<ChiSquareDistance>(query, ids, count, threshold, minDist);
+	}
+}
+
+/*
+* Without a model threshold every metric rejects beyond a default: the
+* chi-square value the demo was tuned with, and half the range of the
+* bounded metrics. A normalized cell adds at most 1 to the intersection
+* distance and at most 2 to L1 and squared Hellinger.
+*/
+double LBPH::metricThreshold(int metric) const {
+	if (_threshold != DBL_MAX)
+		return _threshold;
+	double cells = activeCells();
+	switch (metric) {
+	case METRIC_INTERSECTION:
+		return 0.5 * cells;
+	case METRIC_L1:
+	case METRIC_HELLINGER:
+		return cells;
+	default:
+		return 2100.0;
+	}
+}
+
+void LBPH::setThreshold(double threshold) {
+	_threshold = threshold;
+}
+
+void LBPH::setMetric(int metric) {
+	if (metric < METRIC_CHISQR || metric > METRIC_WEIGHTED_CHISQR) {
+		string error_message = format("Unknown distance metric %d.", metric);
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	_metric = metric;
+	indexSamples(_histograms.size());
+}
+
+void LBPH::setCellWeights(InputArray _weights) {
+	Mat weights = _weights.getMat();
+	if (!weights.empty() && (int)weights.total() != _grid_x * _grid_y) {
+		string error_message = format("Expected %d cell weights, but got %d.", _grid_x * _grid_y, (int)weights.total());
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	if (!weights.empty() && countNonZero(weights.reshape(1, 1) > 0) == 0) {
+		string error_message = "At least one cell needs a positive weight.";
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	// cells of the stored templates before the change
+	vector<int> oldCells = _activeCells;
+	if (oldCells.empty()) {
+		for (int cell = 0; cell < _grid_x * _grid_y; cell++)
+			oldCells.push_back(cell);
+	}
+	Mat oldWeights = _cellWeights;
+	if (weights.empty())
+		_cellWeights.release();
+	else {
+		weights.convertTo(_cellWeights, CV_32FC1);
+		_cellWeights = _cellWeights.reshape(1, 1);
+	}
+	updateCellLayout();
+
+	vector<int> newCells = _activeCells;
+	if (newCells.empty()) {
+		for (int cell = 0; cell < _grid_x * _grid_y; cell++)
+			newCells.push_back(cell);
+	}
+	if (newCells == oldCells)
+		return;
+	// cut the dropped cells out of every template; a cell dropped before
+	// can't be recovered without the images
+	if (!_histograms.empty()) {
+		int numPatterns = _histograms[0].cols / (int)oldCells.size();
+		vector<int> sourceCells(newCells.size());
+		for (size_t c = 0; c < newCells.size(); c++) {
+			vector<int>::const_iterator it = std::lower_bound(oldCells.begin(), oldCells.end(), newCells[c]);
+			if (it == oldCells.end() || *it != newCells[c]) {
+				_cellWeights = oldWeights;
+				updateCellLayout();
+				string error_message = format("Cell %d was dropped from the stored templates. Call clear() before restoring it, then train the model again.", newCells[c]);
+				CV_Error(CV_StsBadArg, error_message);
+			}
+			sourceCells[c] = (int)(it - oldCells.begin());
+		}
+		for (size_t sampleIdx = 0; sampleIdx < _histograms.size(); sampleIdx++) {
+			Mat compact(1, (int)newCells.size() * numPatterns, CV_32FC1);
+			for (size_t c = 0; c < newCells.size(); c++) {
+				_histograms[sampleIdx].colRange(sourceCells[c] * numPatterns, (sourceCells[c] + 1) * numPatterns)
+					.copyTo(compact.colRange((int)c * numPatterns, ((int)c + 1) * numPatterns));
+			}
+			_histograms[sampleIdx] = compact;
+		}
+	}
+	// the quantizers were trained on the old layout, train them again
+	if (_ivfpqEnabled) {
+		_ivfpqEnabled = false;
+		_ivfpq = IVFPQIndex(_ivfpq.nlist(), _ivfpq.codeSize());
+	}
+	clearDerived();
+	indexSamples(0);
+}
+
+void LBPH::clear() {
+	_histograms.clear();
+	_labels.release();
+	_galleryStats = GalleryStats();
+	clearDerived();
+}
+
+void LBPH::updateCellLayout() {
+	_activeCells.clear();
+	_binWeights.release();
+	if (_cellWeights.empty())
+		return;
+	int numCells = _grid_x * _grid_y;
+	for (int cell = 0; cell < numCells; cell++) {
+		if (_cellWeights.at<float>(cell) > 0.f)
+			_activeCells.push_back(cell);
+	}
+	// one weight per histogram bin of the kept cells
+	int numPatterns = static_cast<int>(std::pow(2.0, static_cast<double>(_neighbors)));
+	_binWeights.create(1, (int)_activeCells.size() * numPatterns, CV_32FC1);
+	for (size_t c = 0; c < _activeCells.size(); c++)
+		_binWeights.colRange((int)c * numPatterns, ((int)c + 1) * numPatterns).setTo(_cellWeights.at<float>(_activeCells[c]));
+	// nothing dropped, keep the full layout
+	if ((int)_activeCells.size() == numCells)
+		_activeCells.clear();
+}
+
+void LBPH::loadCellWeights(const String &filename) {
+	FileStorage fs(filename, FileStorage::READ);
+	if (!fs.isOpened())
+		CV_Error(CV_StsError, "File can't be opened for reading!");
+	Mat weights;
+	fs["cell_weights"] >> weights;
+	fs.release();
+	if (weights.empty()) {
+		string error_message = format("No cell_weights found in %s.", filename.c_str());
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	setCellWeights(weights);
+}
+
+/*
+* Fisher ratio per cell: between-label scatter of the cell histograms over
+* their within-label scatter. Cells that look the same for everybody
+* (background, hair, corners) score low. The dropFraction lowest scoring
+* cells get weight 0 and are cut from the gallery.
+*/
+void LBPH::learnCellWeights(double dropFraction) {
+	if (_labelSamples.size() < 2) {
+		string error_message = "Learning the cell weights needs samples of at least two labels.";
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	vector<int> cells = _activeCells;
+	if (cells.empty()) {
+		for (int cell = 0; cell < _grid_x * _grid_y; cell++)
+			cells.push_back(cell);
+	}
+	int numCells = (int)cells.size();
+	int numPatterns = _histograms[0].cols / numCells;
+
+	Mat mean = Mat::zeros(1, _histograms[0].cols, CV_32FC1);
+	for (map<int, Mat>::const_iterator it = _labelSums.begin(); it != _labelSums.end(); ++it)
+		mean += it->second;
+	mean /= (double)_histograms.size();
+
+	vector<double> between(numCells, 0.0), within(numCells, 0.0);
+	for (map<int, vector<int> >::const_iterator it = _labelSamples.begin(); it != _labelSamples.end(); ++it) {
+		const vector<int> &samples = it->second;
+		Mat labelMean = _labelSums.find(it->first)->second / (double)samples.size();
+		for (int c = 0; c < numCells; c++) {
+			Range bins(c * numPatterns, (c + 1) * numPatterns);
+			between[c] += samples.size() * cv::norm(labelMean.colRange(bins), mean.colRange(bins), NORM_L2SQR);
+			for (size_t s = 0; s < samples.size(); s++)
+				within[c] += cv::norm(_histograms[samples[s]].colRange(bins), labelMean.colRange(bins), NORM_L2SQR);
+		}
+	}
+
+	vector<double> ratio(numCells);
+	double maxRatio = 0.0;
+	for (int c = 0; c < numCells; c++) {
+		ratio[c] = between[c] / (within[c] + DBL_EPSILON);
+		maxRatio = std::max(maxRatio, ratio[c]);
+	}
+	// keep at least one cell
+	int numDropped = std::min((int)(std::min(std::max(dropFraction, 0.0), 1.0) * numCells), numCells - 1);
+	vector<double> sorted = ratio;
+	std::sort(sorted.begin(), sorted.end());
+	double cutoff = (numDropped > 0) ? sorted[numDropped - 1] : -1.0;
+
+	Mat weights = Mat::zeros(_grid_y, _grid_x, CV_32FC1);
+	int dropped = 0;
+	for (int c = 0; c < numCells; c++) {
+		if (ratio[c] <= cutoff && dropped < numDropped) {
+			dropped++;
+			continue;
+		}
+		weights.at<float>(cells[c] / _grid_x, cells[c] % _grid_x) =
+			(maxRatio > 0.0) ? std::max((float)(ratio[c] / maxRatio), FLT_EPSILON) : 1.f;
+	}
+	setCellWeights(weights);
+}
+
+void LBPH::reportHNSW(InputArrayOfArrays _queries, const vector<int> &efValues, std::ostream &out) const {
+	if (_hnsw.empty()) {
+		string error_message = "No HNSW graph was built. Did you call buildHNSW?";
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	vector<Mat> src;
+	_queries.getMatVector(src);
+	if (src.empty())
+		return;
+	vector<Mat> queries;
+	for (size_t i = 0; i < src.size(); i++)
+		queries.push_back(extract(src[i]));
+	double numQueries = (double)queries.size();
+
+	// exact reference
+	vector<int> all(_histograms.size());
+	std::iota(all.begin(), all.end(), 0);
+	vector<int> exact(queries.size());
+	double dist;
+	int64 start = getTickCount();
+	for (size_t i = 0; i < queries.size(); i++)
+		exact[i] = rerank(queries[i], all, DBL_MAX, dist);
+	double exactMs = (getTickCount() - start) * 1000.0 / getTickFrequency() / numQueries;
+	out << "exact scan: " << exactMs << " ms/query, " << all.size() << " distances/query" << endl;
+
+	for (size_t e = 0; e < efValues.size(); e++) {
+		size_t evaluated = 0;
+		int hits = 0;
+		vector<int> candidates;
+		start = getTickCount();
+		for (size_t i = 0; i < queries.size(); i++) {
+			searchHNSW(queries[i], efValues[e], _hnswCandidates, candidates, &evaluated);
+			evaluated += candidates.size();
+			if (rerank(queries[i], candidates, DBL_MAX, dist) == exact[i])
+				hits++;
+		}
+		double ms = (getTickCount() - start) * 1000.0 / getTickFrequency() / numQueries;
+		out << "ef=" << efValues[e]
+			<< " recall@1=" << hits / numQueries
+			<< " latency=" << ms << " ms/query (" << exactMs / ms << "x)"
+			<< " distances=" << evaluated / numQueries << "/query" << endl;
+	}
+}
+
+void LBPH::trainIVFPQ(int nlist, int m) {
+	if (_histograms.empty()) {
+		string error_message = "This LBPH model is not computed yet. Did you call the train method?";
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	_ivfpq = IVFPQIndex(nlist, m);
+	_ivfpqEnabled = true;
+	{
+		// the mapped training set only lives while the quantizers are learned
+		Mat roots((int)_histograms.size(), _histograms[0].cols, CV_32FC1);
+		for (int sampleIdx = 0; sampleIdx < roots.rows; sampleIdx++) {
+			Mat root = roots.row(sampleIdx);
+			cv::sqrt(_histograms[sampleIdx], root);
+		}
+		_ivfpq.train(roots);
+	}
+	addIVFPQ();
+}
+
+void LBPH::addIVFPQ() {
+	if (!_ivfpq.isTrained())
+		return;
+	// codes are all the index keeps, the mapped rows are computed on the fly
+	Mat root;
+	for (int id = _ivfpq.size(); id < (int)_histograms.size(); id++) {
+		cv::sqrt(_histograms[id], root);
+		_ivfpq.add(id, root.ptr<float>());
+	}
+}
+
+void LBPH::setIVFPQSearch(int nprobe, int candidates) {
+	_nprobe = std::max(nprobe, 1);
+	_ivfpqCandidates = std::max(candidates, 1);
+}
+
+void LBPH::ivfpqCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const {
+	Mat root;
+	cv::sqrt(query, root);
+	vector<IVFPQIndex::Neighbor> found;
+	_ivfpq.search(root.ptr<float>(), _ivfpqCandidates, _nprobe, found, scanned);
+	candidates.clear();
+	for (size_t i = 0; i < found.size(); i++)
+		candidates.push_back(found[i].second);
+}
+
+void LBPH::searchIVFPQ(InputArray src, int &label, double &dist) const {
+	if (_ivfpq.size() == 0) {
+		string error_message = "The IVF-PQ index is empty. Did you call trainIVFPQ?";
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	Mat query = extract(src);
+	vector<int> candidates;
+	ivfpqCandidates(query, candidates, NULL);
+	int sampleIdx = rerank(query, candidates, metricThreshold(_metric), dist);
+	label = (sampleIdx < 0) ? -1 : _labels.at<int>(sampleIdx);
+}
+
+void LBPH::buildVPTree() {
+	_vptreeEnabled = true;
+	_vptree.clear();
+	indexSamples(_histograms.size());
+}
+
+void LBPH::setVPTreeRadius(double radius) {
+	_vptreeRadius = radius;
+}
+
+void LBPH::setPrototypeSearch(int prototypesPerLabel, int topLabels) {
+	prototypesPerLabel = std::max(prototypesPerLabel, 1);
+	_prototypeTopLabels = std::max(topLabels, 1);
+	if (prototypesPerLabel != _prototypesPerLabel) {
+		_prototypesPerLabel = prototypesPerLabel;
+		for (map<int, vector<int> >::const_iterator it = _labelSamples.begin(); it != _labelSamples.end(); ++it)
+			updatePrototypes(it->first);
+	}
+}
+
+// k-medoids over the given samples (20-50 per person, so the pairwise
+// distance matrix is small). Returns the positions of k distinct medoids
+// in samples, k <= samples.size().
+static vector<int> kMedoids(const vector<Mat> &histograms, const vector<int> &samples, int k)
+{
+	int n = (int)samples.size();
+	Mat dists(n, n, CV_32FC1);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++)
+			dists.at<float>(i, j) = ChiSquareDistance::compute(histograms[samples[i]].ptr<float>(),
+				histograms[samples[j]].ptr<float>(), NULL, histograms[samples[i]].cols);
+	}
+	// farthest-first initialization
+	vector<int> medoids(1, 0);
+	vector<float> nearest(n);
+	for (int i = 0; i < n; i++)
+		nearest[i] = dists.at<float>(i, 0);
+	while ((int)medoids.size() < k) {
+		int next = (int)(std::max_element(nearest.begin(), nearest.end()) - nearest.begin());
+		medoids.push_back(next);
+		for (int i = 0; i < n; i++)
+			nearest[i] = std::min(nearest[i], dists.at<float>(i, next));
+	}
+	// alternate assignment and medoid update
+	vector<int> assignment(n, 0);
+	for (int iter = 0; iter < 10; iter++) {
+		for (int i = 0; i < n; i++) {
+			assignment[i] = 0;
+			for (int c = 1; c < k; c++) {
+				if (dists.at<float>(i, medoids[c]) < dists.at<float>(i, medoids[assignment[i]]))
+					assignment[i] = c;
+			}
+		}
+		bool changed = false;
+		for (int c = 0; c < k; c++) {
+			int best = medoids[c];
+			float bestCost = FLT_MAX;
+			for (int i = 0; i < n; i++) {
+				if (assignment[i] != c)
+					continue;
+				float cost = 0.f;
+				for (int j = 0; j < n; j++) {
+					if (assignment[j] == c)
+						cost += dists.at<float>(j, i);
+				}
+				if (cost < bestCost) {
+					bestCost = cost;
+					best = i;
+				}
+			}
+			changed = changed || (best != medoids[c]);
+			medoids[c] = best;
+		}
+		if (!changed)
+			break;
+	}
+	// identical samples can put two clusters on one medoid; the spare
+	// places go to the samples farthest from the distinct medoids
+	vector<int> distinct;
+	vector<bool> taken(n, false);
+	for (int c = 0; c < k; c++) {
+		if (!taken[medoids[c]]) {
+			taken[medoids[c]] = true;
+			distinct.push_back(medoids[c]);
+		}
+	}
+	while ((int)distinct.size() < k) {
+		int farthest = -1;
+		float farthestDist = -1.f;
+		for (int i = 0; i < n; i++) {
+			if (taken[i])
+				continue;
+			float d = FLT_MAX;
+			for (size_t c = 0; c < distinct.size(); c++)
+				d = std::min(d, dists.at<float>(i, distinct[c]));
+			if (d > farthestDist) {
+				farthestDist = d;
+				farthest = i;
+			}
+		}
+		taken[farthest] = true;
+		distinct.push_back(farthest);
+	}
+	return distinct;
+}
+
+void LBPH::updatePrototypes(int label) {
+	const vector<int> &samples = _labelSamples[label];
+	int n = (int)samples.size();
+	int k = std::min(_prototypesPerLabel, n);
+	if (k <= 1) {
+		// mean histogram
+		_labelPrototypes[label] = _labelSums[label] / n;
+		return;
+	}
+	vector<int> medoids = kMedoids(_histograms, samples, k);
+	Mat prototypes;
+	for (int c = 0; c < k; c++)
+		prototypes.push_back(_histograms[samples[medoids[c]]]);
+	_labelPrototypes[label] = prototypes;
+}
+
+void LBPH::setLabelCapacity(int capacity, int reduction, double mergeThreshold) {
+	if (reduction != REDUCE_KMEDOIDS && reduction != REDUCE_MERGE) {
+		string error_message = format("Unknown gallery reduction %d.", reduction);
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	_labelCapacity = std::max(capacity, 0);
+	_galleryReduction = reduction;
+	_mergeThreshold = mergeThreshold;
+}
+
+/*
+* Brings every label that got samples in [first, _histograms.size()) back
+* to _labelCapacity samples. With REDUCE_MERGE the closest pair of the
+* label is averaged into one sample while its (symmetric) chi-square
+* distance is below _mergeThreshold; whatever is still over capacity is
+* reduced to its k-medoids. The decisions are made on headers of the
+* label's histograms (a merge writes a new Mat, never the stored one), then the gallery is patched in place: merged samples
+* go through replaceSample(), dropped ones through removeSample(), and
+* only the reduced labels get new prototypes. Returns true if samples were
+* removed.
+*/
+bool LBPH::reduceGallery(size_t first) {
+	if (_labelCapacity <= 0)
+		return false;
+	vector<int> labels;
+	for (size_t sampleIdx = first; sampleIdx < _histograms.size(); sampleIdx++) {
+		int label = _labels.at<int>((int)sampleIdx);
+		if ((int)_labelSamples[label].size() > _labelCapacity &&
+			std::find(labels.begin(), labels.end(), label) == labels.end())
+			labels.push_back(label);
+	}
+	if (labels.empty())
+		return false;
+
+	vector<int> removed;
+	for (size_t l = 0; l < labels.size(); l++) {
+		const vector<int> &samples = _labelSamples[labels[l]];
+		int n = (int)samples.size();
+		vector<Mat> histograms(n);
+		for (int i = 0; i < n; i++)
+			histograms[i] = _histograms[samples[i]];
+		vector<bool> alive(n, true), merged(n, false);
+		if (_galleryReduction == REDUCE_MERGE) {
+			int dims = histograms[0].cols;
+			Mat dists(n, n, CV_32FC1, Scalar(FLT_MAX));
+			for (int i = 0; i < n; i++) {
+				for (int j = i + 1; j < n; j++) {
+					const float *a = histograms[i].ptr<float>();
+					const float *b = histograms[j].ptr<float>();
+					dists.at<float>(i, j) = dists.at<float>(j, i) = 0.5f *
+						(ChiSquareDistance::compute(a, b, NULL, dims) + ChiSquareDistance::compute(b, a, NULL, dims));
+				}
+			}
+			int remaining = n;
+			while (remaining > _labelCapacity) {
+				Point closest;
+				double minDist;
+				minMaxLoc(dists, &minDist, NULL, &closest, NULL);
+				if (minDist >= _mergeThreshold)
+					break;
+				// keep the average in the first of the pair
+				int keep = std::min(closest.x, closest.y), drop = std::max(closest.x, closest.y);
+				// a new buffer: the copies share data with _histograms
+				Mat merged;
+				addWeighted(histograms[keep], 0.5, histograms[drop], 0.5, 0, merged);
+				histograms[keep] = merged;
+				merged[keep] = true;
+				alive[drop] = false;
+				remaining--;
+				_galleryStats.merged++;
+				dists.row(drop).setTo(FLT_MAX);
+				dists.col(drop).setTo(FLT_MAX);
+				for (int j = 0; j < n; j++) {
+					if (j == keep || !alive[j])
+						continue;
+					const float *a = histograms[keep].ptr<float>();
+					const float *b = histograms[j].ptr<float>();
+					dists.at<float>(keep, j) = dists.at<float>(j, keep) = 0.5f *
+						(ChiSquareDistance::compute(a, b, NULL, dims) + ChiSquareDistance::compute(b, a, NULL, dims));
+				}
+			}
+		}
+		vector<int> survivors;
+		for (int i = 0; i < n; i++) {
+			if (alive[i])
+				survivors.push_back(i);
+		}
+		if ((int)survivors.size() > _labelCapacity) {
+			vector<int> medoids = kMedoids(histograms, survivors, _labelCapacity);
+			vector<bool> isMedoid(survivors.size(), false);
+			for (size_t c = 0; c < medoids.size(); c++)
+				isMedoid[medoids[c]] = true;
+			for (size_t i = 0; i < survivors.size(); i++) {
+				if (!isMedoid[i]) {
+					alive[survivors[i]] = false;
+					_galleryStats.pruned++;
+				}
+			}
+		}
+		for (int i = 0; i < n; i++) {
+			if (!alive[i])
+				removed.push_back(samples[i]);
+			else if (merged[i])
+				replaceSample(samples[i], histograms[i]);
+		}
+	}
+	// highest ids first, so the last sample that fills a gap is never one
+	// that is still to be removed
+	std::sort(removed.rbegin(), removed.rend());
+	for (size_t i = 0; i < removed.size(); i++)
+		removeSample(removed[i]);
+	for (size_t l = 0; l < labels.size(); l++)
+		updatePrototypes(labels[l]);
+	return true;
+}
+
+/*
+* Replaces the histogram of sample id, e.g. by a merged average, and
+* recomputes its rows in the derived structures that are built. The PCA
+* basis and the signature projection stay as fitted; the VP-tree is
+* dropped for indexSamples() to rebuild.
+*/
+void LBPH::replaceSample(int id, const Mat &hist) {
+	int label = _labels.at<int>(id);
+	if (_postedSamples > 0)
+		erasePostings(id);
+	_labelSums[label] += hist - _histograms[id];
+	_histograms[id] = hist;
+	if (_postedSamples > 0)
+		postSample(id);
+	if (!_hellinger.empty()) {
+		Mat root = _hellinger.row(id);
+		cv::sqrt(hist, root);
+		_hellingerNorms.at<float>(id) = static_cast<float>(root.dot(root));
+	}
+	if (!_coarse.empty())
+		pool(hist, _coarseGrid).copyTo(_coarse.row(id));
+	if (!_signatures.empty())
+		signature(hist).copyTo(_signatures.row(id));
+	if (!_projected.empty())
+		project(hist).copyTo(_projected.row(id));
+	if (_hnswEnabled && _hnsw.size() == (int)_histograms.size())
+		_hnsw.update(id, hnswRows(), hist.cols);
+	if (_ivfpqEnabled && _ivfpq.size() == (int)_histograms.size()) {
+		Mat root;
+		cv::sqrt(hist, root);
+		_ivfpq.update(id, root.ptr<float>());
+	}
+	_vptree.clear();
+}
+
+/*
+* Removes sample id by moving the last sample into its place, in the
+* gallery and in every derived structure that is built, so the ids stay
+* dense. The indexes are patched first, while their rows still hold the
+* old descriptors. The VP-tree has no incremental path and is dropped for
+* indexSamples() to rebuild. Prototypes are left to the caller.
+*/
+void LBPH::removeSample(int id) {
+	int last = (int)_histograms.size() - 1;
+	int label = _labels.at<int>(id), lastLabel = _labels.at<int>(last);
+	if (_hnswEnabled && _hnsw.size() == last + 1)
+		_hnsw.erase(id, hnswRows(), _histograms[0].cols);
+	if (_ivfpqEnabled && _ivfpq.size() == last + 1)
+		_ivfpq.erase(id);
+	_vptree.clear();
+	if (_postedSamples > 0) {
+		erasePostings(id);
+		const float *h = _histograms[last].ptr<float>();
+		for (int d = 0; id != last && d < _histograms[last].cols; d++) {
+			if (h[d] < _invertedMinWeight)
+				continue;
+			vector<pair<int, float> > &list = _postings[d];
+			for (size_t i = 0; i < list.size(); i++) {
+				if (list[i].first == last) {
+					list[i].first = id;
+					break;
+				}
+			}
+		}
+		_postedSamples--;
+	}
+	vector<int> &samples = _labelSamples[label];
+	samples.erase(std::find(samples.begin(), samples.end(), id));
+	_labelSums[label] -= _histograms[id];
+	if (id != last) {
+		vector<int> &lastSamples = _labelSamples[lastLabel];
+		*std::find(lastSamples.begin(), lastSamples.end(), last) = id;
+	}
+	// the last row of every per-sample matrix moves into the gap
+	Mat *perSample[] = { &_labels, &_hellinger, &_hellingerNorms, &_coarse, &_signatures, &_projected };
+	for (Mat *rows : perSample) {
+		if (rows->rows != last + 1)
+			continue;
+		if (id != last)
+			rows->row(last).copyTo(rows->row(id));
+		rows->pop_back();
+	}
+	_histograms[id] = _histograms[last];
+	_histograms.pop_back();
+}
+
+void LBPH::prototypeCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const {
+	// best prototype distance per label
+	vector<pair<double, int> > scores;
+	for (map<int, Mat>::const_iterator it = _labelPrototypes.begin(); it != _labelPrototypes.end(); ++it) {
+		double best = DBL_MAX;
+		for (int p = 0; p < it->second.rows; p++)
+			best = std::min(best, (double)ChiSquareDistance::compute(it->second.ptr<float>(p), query.ptr<float>(), NULL, query.cols));
+		if (scanned)
+			*scanned += it->second.rows;
+		scores.push_back(make_pair(best, it->first));
+	}
+	int top = std::min(_prototypeTopLabels, (int)scores.size());
+	std::partial_sort(scores.begin(), scores.begin() + top, scores.end());
+	candidates.clear();
+	for (int i = 0; i < top; i++) {
+		const vector<int> &samples = _labelSamples.find(scores[i].second)->second;
+		candidates.insert(candidates.end(), samples.begin(), samples.end());
+	}
+}
+
+void LBPH::setPyramidSearch(int coarseGrid, double fraction) {
+	if (coarseGrid <= 0 || _grid_x % coarseGrid != 0 || _grid_y % coarseGrid != 0) {
+		string error_message = format("The coarse grid (%d) must divide the grid size (%dx%d).", coarseGrid, _grid_x, _grid_y);
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	_coarseFraction = std::min(std::max(fraction, 0.0), 1.0);
+	if (coarseGrid != _coarseGrid) {
+		_coarseGrid = coarseGrid;
+		_coarse.release();
+		indexSamples(_histograms.size());
+	}
+}
+
+Mat LBPH::pool(const Mat &hist, int cells) const {
+	int numPatterns = hist.cols / (_grid_x * _grid_y);
+	Mat cellHists = hist.reshape(1, _grid_x * _grid_y);
+	Mat result = Mat::zeros(cells * cells, numPatterns, CV_32FC1);
+	int stepX = _grid_x / cells;
+	int stepY = _grid_y / cells;
+	for (int i = 0; i < _grid_y; i++) {
+		for (int j = 0; j < _grid_x; j++) {
+			Mat row = result.row((i / stepY) * cells + j / stepX);
+			row += cellHists.row(i * _grid_x + j);
+		}
+	}
+	result /= (stepX * stepY);
+	return result.reshape(1, 1);
+}
+
+void LBPH::pyramidCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const {
+	Mat coarseQuery = pool(query, _coarseGrid);
+	vector<pair<double, int> > scores(_coarse.rows);
+	for (int sampleIdx = 0; sampleIdx < _coarse.rows; sampleIdx++)
+		scores[sampleIdx] = make_pair((double)ChiSquareDistance::compute(_coarse.ptr<float>(sampleIdx),
+			coarseQuery.ptr<float>(), NULL, coarseQuery.cols), sampleIdx);
+	if (scanned)
+		*scanned += _coarse.rows;
+	int top = std::max(1, (int)std::ceil(_coarseFraction * _coarse.rows));
+	top = std::min(top, (int)scores.size());
+	std::partial_sort(scores.begin(), scores.begin() + top, scores.end());
+	candidates.resize(top);
+	for (int i = 0; i < top; i++)
+		candidates[i] = scores[i].second;
+}
+
+#if defined(_MSC_VER) && defined(_M_X64)
+// __popcnt64 is the POPCNT instruction, which not every x64 CPU has
+static const bool hasPopcnt = checkHardwareSupport(CV_CPU_POPCNT);
+#endif
+
+static inline int popcount64(uint64 x) {
+#if defined(__GNUC__)
+	// a library call unless the target has POPCNT
+	return __builtin_popcountll(x);
+#else
+#if defined(_MSC_VER) && defined(_M_X64)
+	if (hasPopcnt)
+		return (int)__popcnt64(x);
+#endif
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+void LBPH::setBinarySearch(int bits, int candidates) {
+	if (bits <= 0 || bits % 64 != 0) {
+		string error_message = format("The signature length must be a positive multiple of 64 bits (given %d).", bits);
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	_binaryCandidates = std::max(candidates, 1);
+	if (bits != _signatureBits) {
+		_signatureBits = bits;
+		_signatureProjection.release();
+		_signatures.release();
+		indexSamples(_histograms.size());
+	}
+}
+
+void LBPH::fitSignatures() {
+	// Gaussian projection, reproducible from the seed
+	int dims = _histograms[0].cols;
+	RNG rng(_signatureSeed);
+	_signatureProjection.create(dims, _signatureBits, CV_32FC1);
+	rng.fill(_signatureProjection, RNG::NORMAL, 0.0, 1.0);
+	if (_signatureMean.empty()) {
+		_signatureMean = Mat::zeros(1, dims, CV_32FC1);
+		Mat root;
+		for (size_t sampleIdx = 0; sampleIdx < _histograms.size(); sampleIdx++) {
+			cv::sqrt(_histograms[sampleIdx], root);
+			_signatureMean += root;
+		}
+		_signatureMean /= (double)_histograms.size();
+	}
+	_signatures.release();
+}
+
+Mat LBPH::signature(const Mat &hist) const {
+	Mat root, projected;
+	cv::sqrt(hist, root);
+	root -= _signatureMean;
+	gemm(root, _signatureProjection, 1.0, Mat(), 0.0, projected);
+	// one bit per projection sign, packed into whole 64 bit words
+	Mat result = Mat::zeros(1, _signatureBits / 8, CV_8UC1);
+	uint64 *words = (uint64*)result.data;
+	const float *p = projected.ptr<float>();
+	for (int b = 0; b < _signatureBits; b++) {
+		if (p[b] > 0.f)
+			words[b >> 6] |= (uint64)1 << (b & 63);
+	}
+	return result;
+}
+
+void LBPH::binaryCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const {
+	Mat code = signature(query);
+	const uint64 *q = (const uint64*)code.data;
+	int words = _signatureBits / 64;
+	int n = _signatures.rows;
+	// Hamming distances, bucketed so the k best are found without sorting
+	vector<ushort> dists(n);
+	vector<int> buckets(_signatureBits + 1, 0);
+	for (int sampleIdx = 0; sampleIdx < n; sampleIdx++) {
+		const uint64 *s = (const uint64*)_signatures.ptr(sampleIdx);
+		int d = 0;
+		for (int w = 0; w < words; w++)
+			d += popcount64(s[w] ^ q[w]);
+		dists[sampleIdx] = (ushort)d;
+		buckets[d]++;
+	}
+	if (scanned)
+		*scanned += n;
+	int k = std::min(_binaryCandidates, n);
+	int cutoff = 0;
+	for (int taken = 0; cutoff <= _signatureBits; cutoff++) {
+		taken += buckets[cutoff];
+		if (taken >= k)
+			break;
+	}
+	// everything below the cutoff distance, ties at the cutoff until k
+	candidates.clear();
+	int ties = k;
+	for (int d = 0; d < cutoff; d++)
+		ties -= buckets[d];
+	for (int sampleIdx = 0; sampleIdx < n; sampleIdx++) {
+		if (dists[sampleIdx] < cutoff)
+			candidates.push_back(sampleIdx);
+		else if (dists[sampleIdx] == cutoff && ties > 0) {
+			candidates.push_back(sampleIdx);
+			ties--;
+		}
+	}
+}
+
+void LBPH::setInvertedSearch(float minWeight, int candidates) {
+	if (!(minWeight > 0.f)) {
+		string error_message = format("The posting weight must be positive (given %g).", minWeight);
+		CV_Error(CV_StsBadArg, error_message);
+	}
+	_invertedCandidates = std::max(candidates, 1);
+	if (minWeight != _invertedMinWeight) {
+		_invertedMinWeight = minWeight;
+		_postings.clear();
+		_postedSamples = 0;
+		indexSamples(_histograms.size());
+	}
+}
+
+void LBPH::addPostings() {
+	if (_histograms.empty())
+		return;
+	_postings.resize(_histograms[0].cols);
+	for (size_t sampleIdx = _postedSamples; sampleIdx < _histograms.size(); sampleIdx++)
+		postSample((int)sampleIdx);
+	_postedSamples = _histograms.size();
+}
+
+void LBPH::postSample(int id) {
+	const float *h = _histograms[id].ptr<float>();
+	for (int d = 0; d < _histograms[id].cols; d++) {
+		if (h[d] >= _invertedMinWeight)
+			_postings[d].push_back(make_pair(id, h[d]));
+	}
+}
+
+void LBPH::erasePostings(int id) {
+	const float *h = _histograms[id].ptr<float>();
+	for (int d = 0; d < _histograms[id].cols; d++) {
+		if (h[d] < _invertedMinWeight)
+			continue;
+		vector<pair<int, float> > &list = _postings[d];
+		for (size_t i = 0; i < list.size(); i++) {
+			if (list[i].first == id) {
+				list.erase(list.begin() + i);
+				break;
+			}
+		}
+	}
+}
+
+void LBPH::invertedCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const {
+	// per-thread score buffer, zero outside a query; postings and query
+	// bins are positive, so a zero score marks an untouched sample
+	static thread_local vector<float> scores;
+	if (scores.size() < _histograms.size())
+		scores.resize(_histograms.size(), 0.f);
+	vector<int> touched;
+	const float *q = query.ptr<float>();
+	for (int d = 0; d < query.cols; d++) {
+		if (q[d] <= 0.f)
+			continue;
+		const vector<pair<int, float> > &postings = _postings[d];
+		for (size_t p = 0; p < postings.size(); p++) {
+			float &score = scores[postings[p].first];
+			if (score == 0.f)
+				touched.push_back(postings[p].first);
+			score += std::min(q[d], postings[p].second);
+		}
+		if (scanned)
+			*scanned += postings.size();
+	}
+	int k = std::min(_invertedCandidates, (int)touched.size());
+	std::partial_sort(touched.begin(), touched.begin() + k, touched.end(),
+		[&scores](int a, int b) { return scores[a] > scores[b]; });
+	candidates.assign(touched.begin(), touched.begin() + k);
+	for (size_t i = 0; i < touched.size(); i++)
+		scores[touched[i]] = 0.f;
+}
+
+bool LBPH::searchCandidates(const Mat &query, vector<int> &candidates, SearchStats &stats) const {
+	switch (_searchMode) {
+	case SEARCH_HNSW:
+		if (_hnsw.empty())
+			return false;
+		searchHNSW(query, _efSearch, _hnswCandidates, candidates, &stats.scanned);
+		return true;
+	case SEARCH_IVFPQ:
+		if (_ivfpq.size() == 0)
+			return false;
+		ivfpqCandidates(query, candidates, &stats.scanned);
+		return true;
+	case SEARCH_VPTREE: {
+		if (_vptree.empty())
+			return false;
+		Mat root;
+		cv::sqrt(query, root);
+		float hellingerDist;
+		int nearest = _vptree.nearest(root.ptr<float>(), hellingerRows(), root.cols,
+			(float)std::min(_vptreeRadius, (double)FLT_MAX), hellingerDist, &stats.scanned);
+		candidates.clear();
+		if (nearest >= 0)
+			candidates.push_back(nearest);
+		return true;
+	}
+	case SEARCH_PROTOTYPE:
+		if (_labelPrototypes.empty())
+			return false;
+		prototypeCandidates(query, candidates, &stats.scanned);
+		return true;
+	case SEARCH_PYRAMID:
+		if (_coarse.empty())
+			return false;
+		pyramidCandidates(query, candidates, &stats.scanned);
+		return true;
+	case SEARCH_BINARY:
+		if (_signatures.empty())
+			return false;
+		binaryCandidates(query, candidates, &stats.scanned);
+		return true;
+	case SEARCH_INVERTED:
+		if (_postings.empty())
+			return false;
+		invertedCandidates(query, candidates, &stats.scanned);
+		return true;
+	default:
+		return false;
+	}
+}
+
+void LBPH::write(FileStorage &fs) const {
+	// write matrices
+	fs << "radius" << _radius;
+	fs << "neighbors" << _neighbors;
+	fs << "grid_x" << _grid_x;
+	fs << "grid_y" << _grid_y;
+	fs << "threshold" << _threshold;
+	writeFileNodeList(fs, "histograms", _histograms);
+	fs << "labels" << _labels;
+	fs << "metric" << _metric;
+	fs << "cell_weights" << _cellWeights;
+	fs << "label_capacity" << _labelCapacity;
+	fs << "gallery_reduction" << _galleryReduction;
+	fs << "merge_threshold" << _mergeThreshold;
+	// projection, the projected gallery is rebuilt on load
+	fs << "projection" << _projection;
+	fs << "projection_dims" << _projectionDims;
+	fs << "projected_metric" << _projectedMetric;
+	if (!_pca.eigenvectors.empty()) {
+		fs << "projection_mean" << _pca.mean;
+		fs << "projection_eigenvectors" << _pca.eigenvectors;
+		fs << "projection_eigenvalues" << _pca.eigenvalues;
+	}
+	// search strategy and graph
+	fs << "search_mode" << _searchMode;
+	fs << "hnsw_enabled" << (int)_hnswEnabled;
+	fs << "hnsw_ef_search" << _efSearch;
+	fs << "hnsw_candidates" << _hnswCandidates;
+	if (_hnswEnabled) {
+		fs << "hnsw" << "{";
+		_hnsw.write(fs);
+		fs << "}";
+	}
+	fs << "ivfpq_enabled" << (int)_ivfpqEnabled;
+	fs << "ivfpq_nprobe" << _nprobe;
+	fs << "ivfpq_candidates" << _ivfpqCandidates;
+	if (_ivfpqEnabled) {
+		fs << "ivfpq" << "{";
+		_ivfpq.write(fs);
+		fs << "}";
+	}
+	fs << "prototypes_per_label" << _prototypesPerLabel;
+	fs << "prototype_top_labels" << _prototypeTopLabels;
+	fs << "coarse_grid" << _coarseGrid;
+	fs << "coarse_fraction" << _coarseFraction;
+	fs << "signature_bits" << _signatureBits;
+	fs << "signature_candidates" << _binaryCandidates;
+	fs << "signature_seed" << (double)_signatureSeed;
+	fs << "signature_mean" << _signatureMean;
+	fs << "inverted_min_weight" << _invertedMinWeight;
+	fs << "inverted_candidates" << _invertedCandidates;
+	fs << "vptree_enabled" << (int)_vptreeEnabled;
+	fs << "vptree_radius" << _vptreeRadius;
+	if (_vptreeEnabled) {
+		fs << "vptree" << "{";
+		_vptree.write(fs);
+		fs << "}";
+	}
+}
+
+void LBPH::read(const FileNode &fn) {
+	// read matrices
+	fn["radius"] >> _radius;
+	fn["neighbors"] >> _neighbors;
+	fn["grid_x"] >> _grid_x;
+	fn["grid_y"] >> _grid_y;
+	fn["threshold"] >> _threshold;
+	_histograms.clear();
+	readFileNodeList(fn["histograms"], _histograms);
+	fn["labels"] >> _labels;
+	// the stored templates already have the dropped cells cut out
+	fn["metric"] >> _metric;
+	fn["cell_weights"] >> _cellWeights;
+	if (!_cellWeights.empty())
+		_cellWeights = _cellWeights.reshape(1, 1);
+	updateCellLayout();
+	if (!fn["label_capacity"].empty()) {
+		fn["label_capacity"] >> _labelCapacity;
+		fn["gallery_reduction"] >> _galleryReduction;
+		fn["merge_threshold"] >> _mergeThreshold;
+	}
+	_galleryStats = GalleryStats();
+	_galleryStats.enrolled = _histograms.size();
+	clearDerived();
+	fn["projection"] >> _projection;
+	fn["projection_dims"] >> _projectionDims;
+	fn["projected_metric"] >> _projectedMetric;
+	if (_projection != PROJECTION_NONE) {
+		fn["projection_mean"] >> _pca.mean;
+		fn["projection_eigenvectors"] >> _pca.eigenvectors;
+		fn["projection_eigenvalues"] >> _pca.eigenvalues;
+	}
+	int hnswEnabled = 0;
+	fn["search_mode"] >> _searchMode;
+	fn["hnsw_enabled"] >> hnswEnabled;
+	_hnswEnabled = (hnswEnabled != 0);
+	if (!fn["hnsw_ef_search"].empty()) {
+		fn["hnsw_ef_search"] >> _efSearch;
+		fn["hnsw_candidates"] >> _hnswCandidates;
+	}
+	// a stored graph is reused, samples missing from it are inserted
+	if (_hnswEnabled)
+		_hnsw.read(fn["hnsw"]);
+	int ivfpqEnabled = 0;
+	fn["ivfpq_enabled"] >> ivfpqEnabled;
+	_ivfpqEnabled = (ivfpqEnabled != 0);
+	if (_ivfpqEnabled) {
+		fn["ivfpq_nprobe"] >> _nprobe;
+		fn["ivfpq_candidates"] >> _ivfpqCandidates;
+		_ivfpq.read(fn["ivfpq"]);
+	}
+	if (!fn["prototypes_per_label"].empty()) {
+		fn["prototypes_per_label"] >> _prototypesPerLabel;
+		fn["prototype_top_labels"] >> _prototypeTopLabels;
+	}
+	if (!fn["coarse_grid"].empty()) {
+		fn["coarse_grid"] >> _coarseGrid;
+		fn["coarse_fraction"] >> _coarseFraction;
+	}
+	if (!fn["signature_bits"].empty()) {
+		double seed;
+		fn["signature_bits"] >> _signatureBits;
+		fn["signature_candidates"] >> _binaryCandidates;
+		fn["signature_seed"] >> seed;
+		_signatureSeed = (uint64)seed;
+		fn["signature_mean"] >> _signatureMean;
+	}
+	if (!fn["inverted_min_weight"].empty()) {
+		fn["inverted_min_weight"] >> _invertedMinWeight;
+		fn["inverted_candidates"] >> _invertedCandidates;
+	}
+	int vptreeEnabled = 0;
+	fn["vptree_enabled"] >> vptreeEnabled;
+	_vptreeEnabled = (vptreeEnabled != 0);
+	if (_vptreeEnabled) {
+		fn["vptree_radius"] >> _vptreeRadius;
+		_vptree.read(fn["vptree"]);
+	}
+	indexSamples(0);
+}
+
+void LBPH::save(const String &filename) const {
+	FileStorage fs(filename, FileStorage::WRITE);
+	if (!fs.isOpened())
+		CV_Error(CV_StsError, "File can't be opened for writing!");
+	this->write(fs);
+	fs.release();
+}
+
+void LBPH::load(const String &filename) {
+	FileStorage fs(filename, FileStorage::READ);
+	if (!fs.isOpened())
+		CV_Error(CV_StsError, "File can't be opened for reading!");
+	this->read(fs.root());
+	fs.release();
+}
@@ -7,6 +7,12 @@
 #include <algorithm>
 #include <functional>
 #include <iterator>
+#include <map>
+
+#include "HNSWIndex.h"
+#include "IVFPQIndex.h"
+#include "VPTree.h"
+#include "HistogramDistance.h"
 
 using namespace cv;
 using namespace std;
@@ -14,6 +20,60 @@ using namespace std;
 
 class LBPH
 {
+public:
+	// Optional projection of the spatial histograms, trained in train().
+	enum Projection {
+		PROJECTION_NONE = 0,			// match the raw histograms with chi-square
+		PROJECTION_PCA = 1,				// PCA on the raw histograms
+		PROJECTION_WHITENED_PCA = 2		// whitened PCA on the square-rooted histograms
+	};
+
+	// Distance used in the projected space.
+	enum ProjectedMetric {
+		PROJECTED_L2 = 0,
+		PROJECTED_COSINE = 1
+	};
+
+	// Search strategy used by predict() on the chi-square path.
+	enum SearchMode {
+		SEARCH_LINEAR = 0,	// exact scan over the whole gallery
+		SEARCH_HNSW = 1,	// HNSW candidates re-ranked with exact chi-square
+		SEARCH_IVFPQ = 2,	// IVF-PQ candidates re-ranked with exact chi-square
+		SEARCH_VPTREE = 3,	// exact Hellinger nearest neighbor from the VP-tree
+		SEARCH_PROTOTYPE = 4,	// per-label prototypes first, then the samples of the best labels
+		SEARCH_PYRAMID = 5,		// pooled coarse-grid histograms first, then the best fraction
+		SEARCH_BINARY = 6,		// Hamming prefilter on binary signatures, then exact chi-square
+		SEARCH_INVERTED = 7		// inverted index over (cell, bin) pairs, then exact chi-square
+	};
+
+	// Histogram distance of the exact scan and of the re-ranking step.
+	enum DistanceMetric {
+		METRIC_CHISQR = 0,			// chi-square, as compareHist(CV_COMP_CHISQR)
+		METRIC_INTERSECTION = 1,	// one minus histogram intersection
+		METRIC_L1 = 2,
+		METRIC_HELLINGER = 3,		// squared Hellinger (Bhattacharyya) on the square-rooted gallery
+		METRIC_WEIGHTED_CHISQR = 4	// chi-square with per-cell weights
+	};
+
+	// How a label over its capacity is brought back to it.
+	enum GalleryReduction {
+		REDUCE_KMEDOIDS = 0,	// keep the k-medoids of the label's samples
+		REDUCE_MERGE = 1		// average near-duplicates first, k-medoids for the rest
+	};
+
+	// How much the gallery was shrunk by the per-label capacity.
+	struct GalleryStats {
+		size_t enrolled = 0;	// samples given to train() and update()
+		size_t merged = 0;		// samples averaged into a near-duplicate
+		size_t pruned = 0;		// samples dropped by k-medoids
+	};
+
+	// Work done by a single predict() call.
+	struct SearchStats {
+		size_t scanned = 0;		// coarse evaluations (prototypes, graph nodes, codes, tree nodes)
+		size_t compared = 0;	// gallery samples compared with exact chi-square
+	};
+
 private:
 	int _grid_x;
 	int _grid_y;
@@ -23,6 +83,184 @@ private:
 
 	vector<Mat> _histograms;
 	Mat _labels;
+
+	// projection stage
+	int _projection = PROJECTION_NONE;
+	int _projectionDims = 256;
+	int _projectedMetric = PROJECTED_L2;
+	PCA _pca;
+	Mat _projected;
+
+	// Hellinger-mapped (square-rooted) histograms, one row per sample,
+	// and their squared L2 norms; only while hellingerNeeded()
+	Mat _hellinger;
+	Mat _hellingerNorms;
+
+	// distance metric and per-cell weights (expanded to one weight per bin)
+	int _metric = METRIC_CHISQR;
+	Mat _cellWeights;
+	Mat _binWeights;
+
+	// sorted indices of the cells with a positive weight, empty if all
+	// cells are kept; dropped cells are cut from templates and queries
+	vector<int> _activeCells;
+
+	// per-label capacity of the gallery, 0 for unbounded
+	int _labelCapacity = 0;
+	int _galleryReduction = REDUCE_MERGE;
+	double _mergeThreshold = 10.0;
+	GalleryStats _galleryStats;
+
+	// search strategy and the approximate nearest neighbor graph
+	int _searchMode = SEARCH_LINEAR;
+	bool _hnswEnabled = false;
+	int _efSearch = 64;
+	int _hnswCandidates = 10;
+	HNSWIndex _hnsw;
+
+	// compressed inverted-file index over the Hellinger-mapped histograms
+	bool _ivfpqEnabled = false;
+	int _nprobe = 8;
+	int _ivfpqCandidates = 32;
+	IVFPQIndex _ivfpq;
+
+	// exact metric tree over the Hellinger-mapped histograms
+	bool _vptreeEnabled = false;
+	double _vptreeRadius = DBL_MAX;
+	VPTree _vptree;
+
+	// per-label prototypes (mean histogram or k-medoids) and sample lists
+	int _prototypesPerLabel = 1;
+	int _prototypeTopLabels = 3;
+	map<int, vector<int> > _labelSamples;
+	map<int, Mat> _labelSums;
+	map<int, Mat> _labelPrototypes;
+
+	// histograms pooled into a coarse grid (2x2 or 4x4), one row per
+	// sample; only while SEARCH_PYRAMID is selected
+	int _coarseGrid = 4;
+	double _coarseFraction = 0.1;
+	Mat _coarse;
+
+	// sign-random-projection signatures of the centered Hellinger-mapped
+	// histograms; the projection is regenerated from its seed
+	int _signatureBits = 256;
+	int _binaryCandidates = 64;
+	uint64 _signatureSeed = 0x5f3759df;
+	Mat _signatureMean;
+	Mat _signatureProjection;
+	Mat _signatures;
+
+	// inverted index: for every histogram dimension (cell, LBP bin) the
+	// samples where that bin holds at least _invertedMinWeight, covering
+	// the first _postedSamples samples; only while SEARCH_INVERTED is selected
+	float _invertedMinWeight = 0.01f;
+	int _invertedCandidates = 64;
+	vector<vector<pair<int, float> > > _postings;
+	size_t _postedSamples = 0;
+
+	// Computes the spatial histogram of a single image.
+	Mat extract(InputArray src) const;
+
+	// Fits the projection on all stored histograms.
+	void fitProjection();
+
+	// Maps a spatial histogram into the projected space.
+	Mat project(const Mat &hist) const;
+
+	// Drops everything derived from _histograms.
+	void clearDerived();
+
+	// Builds the derived data for the samples in [first, _histograms.size()).
+	// The structures of the search modes, metrics and indexes are extended
+	// from the samples they already hold, built if they are needed and
+	// missing, and released if they are no longer needed;
+	// indexSamples(_histograms.size()) only does that.
+	void indexSamples(size_t first);
+
+	// True if the metric or an enabled index reads _hellinger.
+	bool hellingerNeeded() const;
+
+	// Nearest neighbor search in the projected space.
+	void predictProjected(const Mat &query, int &label, double &dist) const;
+
+	// Descriptor rows the HNSW graph is built on.
+	HNSWIndex::RowAccessor hnswRows() const;
+	HNSWIndex::RowAccessor hellingerRows() const;
+
+	// Runs the HNSW search for a query histogram.
+	void searchHNSW(const Mat &query, int ef, int k, vector<int> &ids, size_t *evaluated) const;
+
+	// Threshold for distances under metric, one of DistanceMetric.
+	double metricThreshold(int metric) const;
+
+	// Exact chi-square over the given samples, returns the index of the
+	// nearest one below threshold or -1.
+	int rerank(const Mat &query, const vector<int> &candidates, double threshold, double &dist) const;
+
+	// Nearest of count samples (ids, or the first count samples if ids is
+	// NULL) below threshold under the model metric, or -1. Dispatches once
+	// to the scan loop instantiated for that metric.
+	int nearest(const Mat &query, const int *ids, size_t count, double threshold, double &dist) const;
+
+	template <class Metric>
+	int scan(const Mat &query, const int *ids, size_t count, double threshold, double &dist) const;
+
+	// Derives the kept cells and the per-bin weights from _cellWeights.
+	void updateCellLayout();
+
+	// IVF-PQ candidates for a query histogram.
+	void ivfpqCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const;
+
+	// Reduces the labels of the samples in [first, _histograms.size()) that
+	// are over capacity. Returns true if samples were removed.
+	bool reduceGallery(size_t first);
+
+	// Replaces the histogram of a sample and its rows in the derived
+	// structures.
+	void replaceSample(int id, const Mat &hist);
+
+	// Removes a sample; the last sample takes its id.
+	void removeSample(int id);
+
+	// Recomputes the prototypes of one label from its samples.
+	void updatePrototypes(int label);
+
+	// Samples of the labels whose prototypes are closest to the query.
+	void prototypeCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const;
+
+	// Sums the cells of a spatial histogram into a cells x cells grid; each
+	// pooled cell is rescaled to stay a normalized histogram.
+	Mat pool(const Mat &hist, int cells) const;
+
+	// Best fraction of the gallery ranked on the pooled histograms.
+	void pyramidCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const;
+
+	// Draws the random projection and centers it on the current gallery;
+	// the signatures are computed by indexSamples().
+	void fitSignatures();
+
+	// Binary signature (_signatureBits / 8 bytes) of a spatial histogram.
+	Mat signature(const Mat &hist) const;
+
+	// Samples with the smallest Hamming distance to the query signature.
+	void binaryCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const;
+
+	// Appends the samples not posted yet to the posting lists.
+	void addPostings();
+
+	// Adds / removes the postings of one sample's significant bins.
+	void postSample(int id);
+	void erasePostings(int id);
+
+	// Samples with the largest histogram intersection over the posting
+	// lists of the query's non-zero bins.
+	void invertedCandidates(const Mat &query, vector<int> &candidates, size_t *scanned) const;
+
+	// Candidate samples of the current search mode. Returns false if the
+	// whole gallery has to be scanned.
+	bool searchCandidates(const Mat &query, vector<int> &candidates, SearchStats &stats) const;
+
 public:
 	// Computes a LBPH model with images in src and
 	// corresponding labels in labels, possibly preserving
@@ -77,10 +315,169 @@ public:
 	// Predicts the label and confidence for a given sample.
 	void predict(InputArray _src, int &label, double &dist) const;
 
+	// Same as above, stats (if not NULL) receives the work done.
+	void predict(InputArray _src, int &label, double &dist, SearchStats *stats) const;
+
+	// Spatial histogram of an image, in the layout of the stored templates.
+	Mat descriptor(InputArray src) const;
+
+	// Predicts the label and distance of a descriptor from descriptor(),
+	// e.g. one averaged over several frames.
+	void predictDescriptor(const Mat &query, int &label, double &dist, SearchStats *stats = NULL) const;
+
+	// Predicts labels and distances for a batch of query images. Queries
+	// are Hellinger-mapped and matched by L2 distance against the
+	// square-rooted gallery; the cross terms are computed block-wise with
+	// cv::gemm. labels is CV_32SC1, dists CV_64FC1, one row per query.
+	void predictBatch(InputArrayOfArrays src, OutputArray labels, OutputArray dists) const;
+
+	// Selects the projection stage. dims is the number of components kept
+	// (typically 128-512), metric one of ProjectedMetric. A trained model
+	// is refitted at once (PROJECTION_NONE releases the projection). With a
+	// projection set, predict() reports distances in the projected space
+	// and applies the model threshold.
+	void setProjection(int projection, int dims = 256, int metric = PROJECTED_L2);
+
+	// Selects the search strategy used by predict(), one of SearchMode.
+	// SEARCH_BINARY builds its signatures here if the gallery has none and
+	// they are released again when another mode is selected.
+	void setSearchMode(int mode);
+
+	// Builds an HNSW graph over the gallery, either on the Hellinger-mapped
+	// histograms (HNSWIndex::METRIC_L2) or directly on the raw histograms
+	// (HNSWIndex::METRIC_CHISQR). From then on update() inserts new samples
+	// into the graph and save() stores it with the model.
+	void buildHNSW(int M = 16, int efConstruction = 200, int metric = HNSWIndex::METRIC_L2);
+
+	// efSearch is the size of the dynamic candidate list, candidates the
+	// number of graph results re-ranked with exact chi-square.
+	void setHNSWSearch(int efSearch, int candidates = 10);
+
+	// Prints recall@1 and mean latency of the HNSW search against the exact
+	// scan for each efSearch value, over the given query images.
+	void reportHNSW(InputArrayOfArrays queries, const vector<int> &efValues, std::ostream &out) const;
+
+	// Trains the IVF-PQ coarse quantizer (nlist lists) and the product
+	// quantizer (m bytes per code, the descriptor size must be a multiple
+	// of m) on the Hellinger-mapped gallery and encodes every sample. Only
+	// the codes are kept; the mapped gallery is not held in memory.
+	void trainIVFPQ(int nlist = 256, int m = 16);
+
+	// Encodes the gallery samples not yet in the IVF-PQ index. update()
+	// calls this once the index is trained.
+	void addIVFPQ();
+
+	// nprobe is the number of inverted lists visited per query, candidates
+	// the number of codes re-ranked with exact chi-square.
+	void setIVFPQSearch(int nprobe, int candidates = 32);
+
+	// Predicts the label and distance of a sample with the IVF-PQ index.
+	void searchIVFPQ(InputArray src, int &label, double &dist) const;
+
+	// Builds a vantage-point tree over the Hellinger-mapped gallery. It is
+	// rebuilt by update() and stored by save(). With SEARCH_VPTREE,
+	// predict() returns the exact Hellinger nearest neighbor and reports
+	// its chi-square distance.
+	void buildVPTree();
+
+	// Hellinger (L2) radius the VP-tree search starts with. Samples further
+	// away are never reported; a tight radius lets the search skip most of
+	// the gallery.
+	void setVPTreeRadius(double radius);
+
+	// Configures SEARCH_PROTOTYPE: every label is summarized by its mean
+	// histogram (prototypesPerLabel == 1) or by that many k-medoids, kept
+	// up to date by train() and update(). Exact chi-square then runs over
+	// the samples of the topLabels labels with the closest prototypes.
+	void setPrototypeSearch(int prototypesPerLabel, int topLabels);
+
+	// Configures SEARCH_PYRAMID: the gallery is first ranked on histograms
+	// pooled into a coarseGrid x coarseGrid grid (must divide grid_x and
+	// grid_y), then the full-grid chi-square is computed for the best
+	// fraction of it.
+	void setPyramidSearch(int coarseGrid, double fraction);
+
+	// Configures SEARCH_BINARY: every template carries a bits-long
+	// signature (a multiple of 64) from sign random projections of its
+	// Hellinger-mapped histogram; a popcount Hamming scan selects the
+	// candidates re-ranked with exact chi-square. The projection holds
+	// descriptor size x bits floats, so signatures are only kept while
+	// SEARCH_BINARY is selected.
+	void setBinarySearch(int bits, int candidates);
+
+	// Configures SEARCH_INVERTED: a (cell, bin) entry is indexed for a
+	// sample if its normalized count is at least minWeight, which must be
+	// positive; the candidates samples with the largest partial histogram
+	// intersection are re-ranked with exact chi-square. The posting lists
+	// are only kept while SEARCH_INVERTED is selected.
+	void setInvertedSearch(float minWeight, int candidates);
+
+	// Selects the distance used by predict(), one of DistanceMetric.
+	void setMetric(int metric);
+
+	// Distance beyond which predict() reports label -1, in the units of
+	// the selected metric (or of the projected space). DBL_MAX, the
+	// default, uses a per-metric default instead: 2100 for chi-square,
+	// half the range of the other metrics (0.5 per active cell for
+	// intersection, 1 per active cell for L1 and Hellinger; its square
+	// root for predictBatch()). The projected space has no default.
+	void setThreshold(double threshold);
+
+	// Per-cell weights for METRIC_WEIGHTED_CHISQR, grid_y x grid_x or one
+	// row of grid_x * grid_y values. Cells with weight 0 are dropped from
+	// the stored templates and from the query histograms. The templates no
+	// longer hold a dropped cell, so weights that bring one back are only
+	// accepted on an empty model: clear() it, set the weights and train
+	// again with the images. An empty Mat keeps every cell. The
+	// pyramid search needs the full grid, and a trained IVF-PQ index has to
+	// be trained again after cells are dropped.
+	void setCellWeights(InputArray weights);
+
+	// Drops the gallery and everything derived from it. The configuration
+	// (cell weights, metric, search mode, indexes and their parameters) is
+	// kept for the next train().
+	void clear();
+
+	// Reads the weights from the "cell_weights" node of an OpenCV
+	// FileStorage (xml/yml) file.
+	void loadCellWeights(const String &filename);
+
+	// Learns the weights from the Fisher ratio of every cell over the
+	// gallery and drops the dropFraction least discriminative cells.
+	void learnCellWeights(double dropFraction = 0.25);
+
+	// Keeps at most capacity samples per label (0 for unbounded). Labels
+	// over capacity after train() or update() are reduced with reduction,
+	// one of GalleryReduction; mergeThreshold is the chi-square distance
+	// below which two samples count as near-duplicates. A removed sample's
+	// id goes to the last sample; the derived structures are patched in
+	// place (HNSW and IVF-PQ entries erased or re-encoded, postings and
+	// rows moved) except the VP-tree, which has no incremental path and is
+	// rebuilt.
+	void setLabelCapacity(int capacity, int reduction = REDUCE_MERGE, double mergeThreshold = 10.0);
+
+	// Serializes this model to/from a file or file storage.
+	void save(const String &filename) const;
+	void load(const String &filename);
+	void write(FileStorage &fs) const;
+	void read(const FileNode &fn);
+
 	// Getter functions.
 	int neighbors() const { return _neighbors; }
 	int radius() const { return _radius; }
 	int grid_x() const { return _grid_x; }
 	int grid_y() const { return _grid_y; }
+	int projection() const { return _projection; }
+	int projectionDims() const { return _projection == PROJECTION_NONE ? 0 : _pca.eigenvectors.rows; }
+	int searchMode() const { return _searchMode; }
+	int metric() const { return _metric; }
+	double threshold() const { return _threshold; }
+	Mat cellWeights() const { return _cellWeights; }
+	int activeCells() const { return _activeCells.empty() ? _grid_x * _grid_y : (int)_activeCells.size(); }
+	int labelCapacity() const { return _labelCapacity; }
+	const GalleryStats &galleryStats() const { return _galleryStats; }
+	size_t gallerySize() const { return _histograms.size(); }
+	const HNSWIndex &hnsw() const { return _hnsw; }
+	const IVFPQIndex &ivfpq() const { return _ivfpq; }
 
 };
\ No newline at end of file
@@ -5,6 +5,8 @@
 
 #include "Detect_Recognize.h"
 #include "LBPH.h"
+#include "TrackRecognizer.h"
+#include "FaceQuality.h"
 #include "Cv310Text.h"
 
 const cv::String    WINDOW_NAME("Camera video");
@@ -39,6 +41,8 @@ int main(int argc, char** argv)
 
 	LBPH model;
 	model.train(images, labels);
+	TrackRecognizer recognizer(model);
+	FaceQuality quality;
 
 	// ͷ
 	cv::VideoCapture camera(0);
@@ -50,6 +54,7 @@ int main(int argc, char** argv)
 	cv::namedWindow(WINDOW_NAME, cv::WINDOW_KEEPRATIO | cv::WINDOW_AUTOSIZE);
 	//Ƶ֡ʵʶ
 	Detect_Recognize detector(CASCADE_FILE, camera);
+	detector.setTrackerBackend(Detect_Recognize::TRACKER_CORRELATION);
 	cv::Mat frame;
 	double fps = 0, time_per_frame;
 	std::vector<cv::Rect> tface;
@@ -83,19 +88,31 @@ int main(int argc, char** argv)
 
 		int predictedLabel = -1;
 		double predicted_confidence = 0.0;
+		recognizer.beginFrame();
 		if (detector.isFaceFound())
 		{
 			//std::vector<cv::Mat> testface = detector.TestFaces();
 			cv::Mat gray, img;
 			cv::Size ResImgSiz = cv::Size(100, 100);
 			tface = detector.face();
+			std::vector<cv::Rect> extents = detector.faceExtent();
+			std::vector<int> trackIds = detector.trackIds();
+			std::vector<double> confidences = detector.faceConfidence();
 			for (int i = 0; i < detector.faceNum(); i++)
 			{
 				//cv::Mat img = testface[i];
 				cv::cvtColor(frame(tface[i]), gray, cv::COLOR_BGR2GRAY);
-				cv::resize(gray, img, ResImgSiz, CV_INTER_NN);
-
-				model.predict(img, predictedLabel, predicted_confidence);
+				// Poor crops keep the label the track already has
+				if (quality.check(gray, extents[i], frame.size(), confidences[i]) == FaceQuality::ACCEPTED)
+				{
+					cv::resize(gray, img, ResImgSiz, CV_INTER_NN);
+					recognizer.update(trackIds[i], img, predictedLabel, predicted_confidence);
+				}
+				else if (!recognizer.identity(trackIds[i], predictedLabel, predicted_confidence))
+				{
+					predictedLabel = -1;
+					predicted_confidence = DBL_MAX;
+				}
 				if (predicted_confidence > 100)
 					putText(frame, "NO FOUND", Point(tface[i].x + tface[i].width / 2, tface[i].y), CV_FONT_HERSHEY_COMPLEX, 1, Scalar(255, 0, 0));
 				else if (predictedLabel == 1)
@@ -108,11 +125,19 @@ int main(int argc, char** argv)
 			}
 			tface.clear();
 		}
+		// Lost tracks keep their identity until the detector retires them
+		recognizer.retain(detector.liveTrackIds());
+		// Recognition within the frame budget, answers show up next frame
+		recognizer.schedule();
 		
 		cv::imshow(WINDOW_NAME, frame);
 		if (cv::waitKey(25) == 27) break;
 	}
 
+	printf("Face crops checked: %d\n", (int)quality.checked());
+	for (int reason = FaceQuality::TOO_SMALL; reason < FaceQuality::REASON_COUNT; reason++)
+		printf("  skipped, %s: %d\n", FaceQuality::reasonName(reason), (int)quality.skipped(reason));
+
 	return 0;
 }
 
@@ -0,0 +1,254 @@
+#include "TrackRecognizer.h"
+#include "HistogramDistance.h"
+#include <algorithm>
+
+TrackRecognizer::TrackRecognizer(const LBPH &model, double alpha, double changeThreshold, int workers) :
+	m_model(&model)
+{
+	setAlpha(alpha);
+	setChangeThreshold(changeThreshold);
+	for (int i = 0; i < workers; i++)
+		m_workers.push_back(std::thread(&TrackRecognizer::workerLoop, this));
+}
+
+TrackRecognizer::~TrackRecognizer()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+	for (auto &worker : m_workers)
+		worker.join();
+}
+
+void TrackRecognizer::setAlpha(const double alpha)
+{
+	m_alpha = std::min(std::max(alpha, 0.0), 1.0);
+}
+
+double TrackRecognizer::alpha() const
+{
+	return m_alpha;
+}
+
+void TrackRecognizer::setChangeThreshold(const double threshold)
+{
+	m_changeThreshold = std::max(threshold, 0.0);
+}
+
+double TrackRecognizer::changeThreshold() const
+{
+	return m_changeThreshold;
+}
+
+void TrackRecognizer::setFrameBudget(const double ms)
+{
+	m_frameBudget = std::max(ms, 0.0);
+}
+
+double TrackRecognizer::frameBudget() const
+{
+	return m_frameBudget;
+}
+
+void TrackRecognizer::setConfirmations(const int count)
+{
+	m_confirmations = std::max(count, 1);
+}
+
+int TrackRecognizer::confirmations() const
+{
+	return m_confirmations;
+}
+
+void TrackRecognizer::setRefreshPeriod(const int frames)
+{
+	m_refreshPeriod = std::max(frames, 1);
+}
+
+int TrackRecognizer::refreshPeriod() const
+{
+	return m_refreshPeriod;
+}
+
+int TrackRecognizer::workers() const
+{
+	return (int)m_workers.size();
+}
+
+size_t TrackRecognizer::trackCount() const
+{
+	return m_tracks.size();
+}
+
+size_t TrackRecognizer::updates() const
+{
+	return m_updates;
+}
+
+size_t TrackRecognizer::queries() const
+{
+	return m_queries;
+}
+
+double TrackRecognizer::queryTime() const
+{
+	return m_queryTime;
+}
+
+void TrackRecognizer::run(Query &query) const
+{
+	int64 start = cv::getTickCount();
+	m_model->predictDescriptor(query.descriptor, query.label, query.dist);
+	query.ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+}
+
+void TrackRecognizer::workerLoop()
+{
+	while (true) {
+		Query query;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wakeUp.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+			if (m_stop)
+				return;
+			query = m_jobs.front();
+			m_jobs.pop_front();
+		}
+		run(query);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_results.push_back(query);
+	}
+}
+
+void TrackRecognizer::attach(const Query &query)
+{
+	m_queryTime = (m_queries == 0) ? query.ms : 0.9 * m_queryTime + 0.1 * query.ms;
+	m_queries++;
+
+	// The track may have ended while the query was running
+	auto it = m_tracks.find(query.trackId);
+	if (it == m_tracks.end())
+		return;
+	Track &track = it->second;
+	track.hits = (query.label == track.label && !track.matched.empty()) ? track.hits + 1 : 1;
+	track.label = query.label;
+	track.dist = query.dist;
+	track.matched = query.descriptor;
+	track.age = 0;
+	track.pending = false;
+}
+
+void TrackRecognizer::beginFrame()
+{
+	std::deque<Query> results;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		results.swap(m_results);
+	}
+	for (size_t i = 0; i < results.size(); i++)
+		attach(results[i]);
+	for (auto &entry : m_tracks)
+		entry.second.age++;
+}
+
+void TrackRecognizer::update(int trackId, const cv::Mat &face, int &label, double &dist)
+{
+	Track &track = m_tracks[trackId];
+	cv::Mat hist = m_model->descriptor(face);
+	m_updates++;
+
+	// Averages of normalized cell histograms stay normalized
+	if (track.descriptor.empty())
+		track.descriptor = hist;
+	else
+		cv::addWeighted(hist, m_alpha, track.descriptor, 1.0 - m_alpha, 0.0, track.descriptor);
+
+	label = track.label;
+	dist = track.dist;
+}
+
+/*
+* Smaller is more urgent: 0 for tracks without answer, 1 for unconfirmed
+* tracks, 2 for tracks whose descriptor drifted, 3 for confirmed tracks due
+* for a refresh. Tracks that need nothing get -1.
+*/
+int TrackRecognizer::priority(const Track &track) const
+{
+	if (track.pending || track.descriptor.empty())
+		return -1;
+	if (track.matched.empty())
+		return 0;
+	if (track.hits < m_confirmations)
+		return 1;
+	if (ChiSquareDistance::compute(track.matched.ptr<float>(), track.descriptor.ptr<float>(), NULL,
+		track.descriptor.cols) > m_changeThreshold)
+		return 2;
+	if (track.age >= m_refreshPeriod)
+		return 3;
+	return -1;
+}
+
+void TrackRecognizer::schedule()
+{
+	// (priority, -age, track id): most urgent and oldest answer first
+	std::vector<std::pair<std::pair<int, int>, int> > order;
+	for (auto &entry : m_tracks) {
+		int p = priority(entry.second);
+		if (p >= 0)
+			order.push_back(std::make_pair(std::make_pair(p, -entry.second.age), entry.first));
+	}
+	std::sort(order.begin(), order.end());
+
+	int64 start = cv::getTickCount();
+	double planned = 0;
+	for (size_t i = 0; i < order.size(); i++) {
+		// Asynchronous queries are planned with the measured average cost,
+		// inline queries with the time actually spent
+		double spent = m_workers.empty() ?
+			(cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency() : planned;
+		if (i > 0 && spent + (m_workers.empty() ? 0 : m_queryTime) > m_frameBudget)
+			break;
+
+		Track &track = m_tracks[order[i].second];
+		Query query;
+		query.trackId = order[i].second;
+		query.descriptor = track.descriptor.clone();
+		if (m_workers.empty()) {
+			run(query);
+			attach(query);
+		}
+		else {
+			track.pending = true;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_jobs.push_back(query);
+			}
+			m_wakeUp.notify_one();
+			planned += m_queryTime;
+		}
+	}
+}
+
+bool TrackRecognizer::identity(int trackId, int &label, double &dist, int *age) const
+{
+	auto it = m_tracks.find(trackId);
+	if (it == m_tracks.end() || it->second.matched.empty())
+		return false;
+	label = it->second.label;
+	dist = it->second.dist;
+	if (age)
+		*age = it->second.age;
+	return true;
+}
+
+void TrackRecognizer::retain(const std::vector<int> &trackIds)
+{
+	for (auto it = m_tracks.begin(); it != m_tracks.end();) {
+		if (std::find(trackIds.begin(), trackIds.end(), it->first) == trackIds.end())
+			it = m_tracks.erase(it);
+		else
+			++it;
+	}
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <opencv2\core.hpp>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "LBPH.h"
+
+// Recognition per track instead of per frame. Every track keeps an
+// exponential moving average of the LBPH histograms of its face crops and
+// an identity cache (last label, distance and age). Gallery queries are
+// scheduled once per frame under a time budget: new tracks first, then
+// unconfirmed ones, then tracks whose average drifted significantly
+// (chi-square) from the one matched last, then confirmed tracks
+// round-robin, oldest answer first. Queries run on a worker pool and
+// attach to their track on the next frame.
+class TrackRecognizer
+{
+public:
+	// workers is the size of the worker pool, 0 runs the queries in
+	// schedule() on the calling thread.
+	TrackRecognizer(const LBPH &model, double alpha = 0.2, double changeThreshold = 5.0, int workers = 1);
+	~TrackRecognizer();
+
+	// Starts a frame: attaches the finished queries and ages every track.
+	void					beginFrame();
+
+	// Folds the face crop of a track into its running descriptor and
+	// returns the cached label and distance of the track (-1 and DBL_MAX
+	// until its first query finished).
+	void					update(int trackId, const cv::Mat &face, int &label, double &dist);
+
+	// Submits the queries of this frame within the budget.
+	void					schedule();
+
+	// Cached identity of a track. age is the number of frames since the
+	// answer. Returns false for unknown tracks and tracks without answer.
+	bool					identity(int trackId, int &label, double &dist, int *age = NULL) const;
+
+	// Forgets every track not in trackIds.
+	void					retain(const std::vector<int> &trackIds);
+
+	void					setAlpha(const double alpha);
+	double					alpha() const;
+	void					setChangeThreshold(const double threshold);
+	double					changeThreshold() const;
+	// Milliseconds of queries submitted per frame; at least one query is
+	// submitted every frame so no track starves
+	void					setFrameBudget(const double ms);
+	double					frameBudget() const;
+	// Consecutive equal answers before a track counts as confirmed
+	void					setConfirmations(const int count);
+	int						confirmations() const;
+	// Frames between two refreshes of a confirmed track
+	void					setRefreshPeriod(const int frames);
+	int						refreshPeriod() const;
+	int						workers() const;
+	size_t					trackCount() const;
+	// Descriptors folded in and gallery queries run so far
+	size_t					updates() const;
+	size_t					queries() const;
+	// Running average of the query time in milliseconds
+	double					queryTime() const;
+
+private:
+	struct Track
+	{
+		cv::Mat				descriptor;		// running average
+		cv::Mat				matched;		// descriptor at the last query
+		int					label = -1;
+		double				dist = DBL_MAX;
+		int					age = 0;		// frames since the last answer
+		int					hits = 0;		// consecutive equal answers
+		bool				pending = false;
+	};
+
+	struct Query
+	{
+		int					trackId;
+		cv::Mat				descriptor;
+		int					label = -1;
+		double				dist = DBL_MAX;
+		double				ms = 0;
+	};
+
+	const LBPH*				m_model;
+	double					m_alpha;
+	double					m_changeThreshold;
+	double					m_frameBudget = 5;
+	int						m_confirmations = 3;
+	int						m_refreshPeriod = 25;
+	std::map<int, Track>	m_tracks;
+	size_t					m_updates = 0;
+	size_t					m_queries = 0;
+	double					m_queryTime = 0;
+
+	// worker pool
+	std::vector<std::thread>	m_workers;
+	std::mutex				m_mutex;
+	std::condition_variable	m_wakeUp;
+	std::deque<Query>		m_jobs;
+	std::deque<Query>		m_results;
+	bool					m_stop = false;
+
+	void		run(Query &query) const;
+	void		workerLoop();
+	void		attach(const Query &query);
+	int			priority(const Track &track) const;
+};
\ No newline at end of file
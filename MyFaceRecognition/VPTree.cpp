@@ -0,0 +1,169 @@
+#include "VPTree.h"
+#include <opencv2/core/hal/hal.hpp>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Nodes with fewer items compute their distances on the calling thread
+const int PARALLEL_MIN_ITEMS = 2048;
+
+class DistanceBody : public cv::ParallelLoopBody
+{
+public:
+	DistanceBody(const float *vantage, const int *items, float *dists,
+		const VPTree::RowAccessor &rows, int dims) :
+		m_vantage(vantage), m_items(items), m_dists(dists), m_rows(rows), m_dims(dims) {}
+
+	void operator()(const cv::Range &range) const
+	{
+		for (int i = range.start; i < range.end; i++)
+			m_dists[i] = std::sqrt(cv::hal::normL2Sqr_(m_rows(m_items[i]), m_vantage, m_dims));
+	}
+
+private:
+	const float					*m_vantage;
+	const int					*m_items;
+	float						*m_dists;
+	const VPTree::RowAccessor	&m_rows;
+	int							m_dims;
+};
+
+}
+
+void VPTree::clear()
+{
+	m_nodes.clear();
+}
+
+void VPTree::build(int count, const RowAccessor &rows, int dims)
+{
+	m_nodes.assign(count, Node());
+	std::vector<int> items(count);
+	for (int i = 0; i < count; i++)
+		items[i] = i;
+	std::vector<float> dists(count);
+	cv::RNG rng;
+	buildNode(items, dists, 0, count, rows, dims, rng);
+}
+
+void VPTree::buildNode(std::vector<int> &items, std::vector<float> &dists, int lo, int hi,
+	const RowAccessor &rows, int dims, cv::RNG &rng)
+{
+	// explicit stack, the tree can be deep for degenerate data
+	std::vector<std::pair<int, int> > pending(1, std::make_pair(lo, hi));
+	while (!pending.empty()) {
+		lo = pending.back().first;
+		hi = pending.back().second;
+		pending.pop_back();
+
+		Node &node = m_nodes[lo];
+		node.end = hi;
+		node.outside = -1;
+		node.threshold = 0.f;
+
+		// random vantage point moved to the front of the range
+		std::swap(items[lo], items[lo + rng.uniform(0, hi - lo)]);
+		node.id = items[lo];
+		if (hi - lo == 1)
+			continue;
+
+		// distances of the remaining items to the vantage point
+		DistanceBody body(rows(node.id), &items[0], &dists[0], rows, dims);
+		cv::Range range(lo + 1, hi);
+		if (hi - lo > PARALLEL_MIN_ITEMS)
+			cv::parallel_for_(range, body);
+		else
+			body(range);
+
+		// split at the median: inside [lo + 1, mid), outside [mid, hi)
+		int mid = lo + 1 + (hi - lo - 1) / 2;
+		std::vector<std::pair<float, int> > order(hi - lo - 1);
+		for (int i = lo + 1; i < hi; i++)
+			order[i - lo - 1] = std::make_pair(dists[i], items[i]);
+		std::nth_element(order.begin(), order.begin() + (mid - lo - 1), order.end());
+		for (int i = lo + 1; i < hi; i++)
+			items[i] = order[i - lo - 1].second;
+		node.threshold = order[mid - lo - 1].first;
+		node.outside = mid;
+
+		pending.push_back(std::make_pair(mid, hi));
+		if (mid > lo + 1)
+			pending.push_back(std::make_pair(lo + 1, mid));
+	}
+}
+
+void VPTree::search(int node, const float *query, const RowAccessor &rows, int dims,
+	float &tau, int &best, size_t *visited) const
+{
+	const Node &n = m_nodes[node];
+	float d = std::sqrt(cv::hal::normL2Sqr_(rows(n.id), query, dims));
+	if (visited)
+		(*visited)++;
+	if (d < tau) {
+		tau = d;
+		best = n.id;
+	}
+	if (n.outside < 0)
+		return;
+
+	int inside = (n.outside > node + 1) ? node + 1 : -1;
+	// visit the side containing the query first, the other one only if
+	// the ball of radius tau crosses the median sphere
+	if (d < n.threshold) {
+		if (inside >= 0 && d - tau < n.threshold)
+			search(inside, query, rows, dims, tau, best, visited);
+		if (d + tau >= n.threshold)
+			search(n.outside, query, rows, dims, tau, best, visited);
+	}
+	else {
+		if (d + tau >= n.threshold)
+			search(n.outside, query, rows, dims, tau, best, visited);
+		if (inside >= 0 && d - tau < n.threshold)
+			search(inside, query, rows, dims, tau, best, visited);
+	}
+}
+
+int VPTree::nearest(const float *query, const RowAccessor &rows, int dims, float radius,
+	float &dist, size_t *visited) const
+{
+	int best = -1;
+	dist = radius;
+	if (!m_nodes.empty())
+		search(0, query, rows, dims, dist, best, visited);
+	return best;
+}
+
+void VPTree::write(cv::FileStorage &fs) const
+{
+	std::vector<int> ids, outside, end;
+	std::vector<float> thresholds;
+	for (size_t i = 0; i < m_nodes.size(); i++) {
+		ids.push_back(m_nodes[i].id);
+		thresholds.push_back(m_nodes[i].threshold);
+		outside.push_back(m_nodes[i].outside);
+		end.push_back(m_nodes[i].end);
+	}
+	fs << "ids" << ids;
+	fs << "thresholds" << thresholds;
+	fs << "outside" << outside;
+	fs << "end" << end;
+}
+
+void VPTree::read(const cv::FileNode &fn)
+{
+	std::vector<int> ids, outside, end;
+	std::vector<float> thresholds;
+	fn["ids"] >> ids;
+	fn["thresholds"] >> thresholds;
+	fn["outside"] >> outside;
+	fn["end"] >> end;
+	CV_Assert(thresholds.size() == ids.size() && outside.size() == ids.size() && end.size() == ids.size());
+	m_nodes.resize(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		m_nodes[i].id = ids[i];
+		m_nodes[i].threshold = thresholds[i];
+		m_nodes[i].outside = outside[i];
+		m_nodes[i].end = end[i];
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <functional>
+#include <vector>
+
+// Vantage-point tree for exact nearest neighbor search under the L2
+// distance, e.g. on Hellinger-mapped histograms. Every node splits its
+// subtree at the median distance to its vantage point; the triangle
+// inequality lets queries skip whole subtrees. Like HNSWIndex, the tree
+// only stores ids and reads descriptor rows through a RowAccessor.
+class VPTree
+{
+public:
+	typedef std::function<const float*(int)>	RowAccessor;
+
+	// Builds the tree over ids 0 .. count-1. Distance computations of
+	// large nodes are spread over the OpenCV thread pool.
+	void					build(int count, const RowAccessor &rows, int dims);
+	void					clear();
+	bool					empty() const { return m_nodes.empty(); }
+	int						size() const { return (int)m_nodes.size(); }
+
+	// Returns the id of the exact nearest neighbor closer than radius, or
+	// -1. dist receives its L2 distance; visited, if given, the number of
+	// distance computations.
+	int						nearest(const float *query, const RowAccessor &rows, int dims, float radius,
+								float &dist, size_t *visited = NULL) const;
+
+	void					write(cv::FileStorage &fs) const;
+	void					read(const cv::FileNode &fn);
+
+private:
+	// Nodes are stored in pre-order: the subtree of node i occupies
+	// [i, i + subtree size), its inside child (if any) is i + 1.
+	struct Node {
+		int		id;
+		float	threshold;	// median distance to the vantage point
+		int		outside;	// first node of the outside subtree, or -1
+		int		end;		// one past the last node of this subtree
+	};
+	std::vector<Node>		m_nodes;
+
+	void		buildNode(std::vector<int> &items, std::vector<float> &dists, int lo, int hi,
+					const RowAccessor &rows, int dims, cv::RNG &rng);
+	void		search(int node, const float *query, const RowAccessor &rows, int dims,
+					float &tau, int &best, size_t *visited) const;
+};